@@ -31,27 +31,38 @@
 
 #if defined (EMC_WINDOWS)
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #include <windows.h>
 #include <time.h>
 #include <memory.h>
 #else
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/sem.h>
 #include <semaphore.h>
 #include <unistd.h>
+#include <signal.h>
 #include <iconv.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/epoll.h>
 #include <sys/poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <sys/un.h>
+#include <linux/filter.h>
+#include <linux/errqueue.h>
 #include <arpa/inet.h>
+#include <ifaddrs.h>
 #endif
 #include <stdarg.h>
 #include <string.h>
@@ -134,7 +145,8 @@
 #define PATH_LEN	PATH_MAX
 #endif
 
-#define ADDR_LEN	16
+// Long enough for the text form of an ipv6 address
+#define ADDR_LEN	46
 
 // Packet size
 #define MAX_DATA_SIZE	8192
@@ -142,10 +154,11 @@
 #define MAX_PROTOCOL_SIZE	8196
 //tcp data length
 #define TCP_DATA_SIZE	8179
-//ipc data length
-#define IPC_DATA_SIZE	8175
 // Header logo
 #define EMC_HEAD		0x5876
+// Header logo of a compact frame,followed by a varint length.
+// Two bytes like EMC_HEAD,a stream resynchronizing is as unlikely to stop on payload
+#define EMC_HEAD_COMPACT	0x5976
 
 // Login command
 #define EMC_CMD_LOGIN	0x61
@@ -153,6 +166,8 @@
 #define EMC_CMD_LOGOUT	0x62
 // Data command
 #define EMC_CMD_DATA	0x63
+// Loaned data command,carries the offset of a block in the shared memory
+#define EMC_CMD_LOAN	0x64
 
 //Loopback address 127.0.0.1
 #define LOOPBACK		0x100007F
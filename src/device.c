@@ -43,6 +43,12 @@ struct emc_device{
 	uint				operate;
 	// thread number
 	uint				thread;
+	// Cpu mask of the device threads
+	uint64				affinity;
+	// Busy poll budget in microseconds
+	uint				busypoll;
+	// Zero copy message size threshold
+	uint				zerocopy;
 	// tcp manager
 	struct tcp_mgr	 *	mgr;
 	//Monitor message queue
@@ -107,6 +113,7 @@ void emc_destory(int device){
 
  int emc_set(int device, int opt, void * optval, int optlen){
 	 int add=0;
+	 uint64 mask=0;
 	 struct emc_device * ed = (struct emc_device *)global_get_device(device);
 	 if(!ed){
 		 errno = ENODEVICE;
@@ -121,10 +128,21 @@ void emc_destory(int device){
 	}else if(sizeof(int64) == optlen){
 		add = *(int64 *)optval;
 	}
+	mask = sizeof(int64) == optlen ? *(uint64 *)optval : (uint)add;
 	if(opt & EMC_OPT_THREAD){
 		if(ed->mgr) return -1;
 		if(add <= 0) add = 1;
 		ed->thread = add;
+	}else if(opt & EMC_OPT_AFFINITY){
+		if(ed->mgr) return -1;
+		ed->affinity = mask;
+		global_add_affinity(mask);
+	}else if(opt & EMC_OPT_BUSYPOLL){
+		if(add < 0) add = 0;
+		ed->busypoll = add;
+	}else if(opt & EMC_OPT_ZEROCOPY){
+		if(add < 0) add = 0;
+		ed->zerocopy = add;
 	}else{
 		if(add > 0){
 			if(opt & EMC_OPT_MONITOR){
@@ -133,6 +151,12 @@ void emc_destory(int device){
 			if(opt & EMC_OPT_CONTROL){
 				ed->operate |= EMC_OPT_CONTROL;
 			}
+			if(opt & EMC_OPT_INLINE){
+				ed->operate |= EMC_OPT_INLINE;
+			}
+			if(opt & EMC_OPT_BALANCE){
+				ed->operate |= EMC_OPT_BALANCE;
+			}
 		}else{
 			if(opt & EMC_OPT_MONITOR){
 				ed->operate &= ~EMC_OPT_MONITOR;
@@ -140,6 +164,12 @@ void emc_destory(int device){
 			if(opt & EMC_OPT_CONTROL){
 				ed->operate &= ~EMC_OPT_CONTROL;
 			}
+			if(opt & EMC_OPT_INLINE){
+				ed->operate &= ~EMC_OPT_INLINE;
+			}
+			if(opt & EMC_OPT_BALANCE){
+				ed->operate &= ~EMC_OPT_BALANCE;
+			}
 		}
 	}
 	return 0;
@@ -206,6 +236,24 @@ uint get_device_control(int device){
 	return (ed->operate & EMC_OPT_CONTROL);
 }
 
+uint get_device_inline(int device){
+	struct emc_device * ed = (struct emc_device *)global_get_device(device);
+	if(!ed){
+		errno = ENODEVICE;
+		return 0;
+	}
+	return (ed->operate & EMC_OPT_INLINE);
+}
+
+uint get_device_balance(int device){
+	struct emc_device * ed = (struct emc_device *)global_get_device(device);
+	if(!ed){
+		errno = ENODEVICE;
+		return 0;
+	}
+	return (ed->operate & EMC_OPT_BALANCE);
+}
+
 struct tcp_mgr * get_device_tcp_mgr(int device){
 	struct emc_device * ed = (struct emc_device *)global_get_device(device);
 	if(!ed){
@@ -232,6 +280,33 @@ uint get_device_thread(int device){
 	return ed->thread;
 }
 
+uint64 get_device_affinity(int device){
+	struct emc_device * ed = (struct emc_device *)global_get_device(device);
+	if(!ed){
+		errno = ENODEVICE;
+		return 0;
+	}
+	return ed->affinity;
+}
+
+uint get_device_busypoll(int device){
+	struct emc_device * ed = (struct emc_device *)global_get_device(device);
+	if(!ed){
+		errno = ENODEVICE;
+		return 0;
+	}
+	return ed->busypoll;
+}
+
+uint get_device_zerocopy(int device){
+	struct emc_device * ed = (struct emc_device *)global_get_device(device);
+	if(!ed){
+		errno = ENODEVICE;
+		return 0;
+	}
+	return ed->zerocopy;
+}
+
 int add_device_plug(int device, int plug, void * p){
 	struct emc_device * ed = (struct emc_device *)global_get_device(device);
 	if(!ed){
@@ -36,10 +36,16 @@ extern "C"{
 	struct tcp_mgr * get_device_tcp_mgr(int id);
 	void set_device_tcp_mgr(int id, struct tcp_mgr *mgr);
 	uint get_device_thread(int id);
+	uint64 get_device_affinity(int id);
+	uint get_device_busypoll(int id);
+	uint get_device_zerocopy(int id);
 	// The device is monitoring events
 	uint get_device_monitor(int id);
 	// Whether the device can be controlled
 	uint get_device_control(int id);
+	// Whether an idle connection is written by the sending thread
+	uint get_device_inline(int id);
+	uint get_device_balance(int id);
 	int push_device_event(int id, void * data);
 
 	int add_device_plug(int id, int plug, void * p);
@@ -146,8 +146,12 @@ struct monitor_data{
 	int		events;
 	// A unique number for each connection
 	int		id;
-	char	ip[16];
+	char	ip[46];
 	int		port;
+	// Credentials of the peer process,valid only for unix socket connections
+	int		pid;
+	int		uid;
+	int		gid;
 	// Monitoring event returns additional items
 	void	*addition; 
 };
@@ -163,6 +167,33 @@ struct monitor_data{
 #define EMC_OPT_MONITOR			1	// Set the device to monitor events
 #define EMC_OPT_CONTROL			2	// Settings are available to control plug
 #define EMC_OPT_THREAD			4	// Set the device thread number,valid only for tcp
+#define EMC_OPT_INLINE			8	// Send from the calling thread while the connection is idle,valid only for tcp
+#define EMC_OPT_BALANCE			16	// Move busy connections to less loaded device threads,valid only for tcp
+#define EMC_OPT_AFFINITY		32	// Set the cpu mask of the device threads,each tcp thread takes one cpu of the mask
+#define EMC_OPT_BUSYPOLL		64	// Set the microseconds tcp threads spin without sleeping after the last activity,0 off
+#define EMC_OPT_ZEROCOPY		128	// Set the message size from which tcp sends without copying(MSG_ZEROCOPY),0 off
+
+// easymc plug options,set by emc_plug_set before emc_bind or emc_connect
+#define EMC_PLUG_BACKLOG		1	// Length of the listen queue of a bound plug,default SOMAXCONN
+#define EMC_PLUG_REUSEPORT		2	// 1 one SO_REUSEPORT listener per device thread,2 also steer connections by cpu,valid only for tcp
+#define EMC_PLUG_NODELAY		3	// 1 send small frames without delay(TCP_NODELAY),valid only for tcp
+#define EMC_PLUG_CORK			4	// 1 hold partial segments until the send queue is drained(TCP_CORK),valid only for tcp
+#define EMC_PLUG_SNDBUF			5	// Socket send buffer size in bytes,0 system default,valid only for tcp
+#define EMC_PLUG_RCVBUF			6	// Socket receive buffer size in bytes,0 system default,valid only for tcp
+#define EMC_PLUG_KEEPIDLE		7	// Idle seconds before the keepalive probes,default 10,valid only for tcp
+#define EMC_PLUG_KEEPINTVL		8	// Seconds between the keepalive probes,default 3,valid only for tcp
+#define EMC_PLUG_KEEPCNT		9	// Unanswered probes before the connection is dropped,default 5,valid only for tcp
+#define EMC_PLUG_NOTSENT_LOWAT	10	// Unsent bytes in the socket above which it is not writable,0 unlimited,valid only for tcp
+#define EMC_PLUG_UNIX			11	// 1 bound plugs also listen on a unix socket and local connects use it instead of shared memory,valid only for linux
+#define EMC_PLUG_COMPRESS		12	// Codec the client asks for,any value lets a bound plug accept the asked codec,0 off,valid only for tcp
+#define EMC_PLUG_COMPRESS_MIN	13	// Frames below this many bytes are sent as they are,default 256,valid only for tcp
+#define EMC_PLUG_QUANTUM		14	// Bytes a connection may read or write per turn of its area,a message costs 256 more,default 65536,valid only for tcp
+#define EMC_PLUG_IPC_RING		15	// Bytes of each shared memory ring,a larger message is sent in fragments,default 1048576,valid only for a bound ipc plug
+#define EMC_PLUG_IPC_HEAP		16	// Bytes each peer loans messages from,default 4194304,negative no loans,valid only for a bound ipc plug
+#define EMC_PLUG_IPC_CAST		17	// Bytes published messages are written once to,at least a ring and a longer message is lost,default 4194304,valid only for a bound ipc plug
+
+// easymc compression codecs
+#define EMC_CODEC_LZ			1	// Built-in lz codec,ids up to 15 can be registered by emc_codec
 
 // easymc events type
 #define EMC_EVENT_ACCEPT		1	// Service to accept a new connection
@@ -204,6 +235,12 @@ EMC_EXP emc_result_t EMC_BIND emc_thread(emc_thread_cb * cb, void * args);
 // Wait thread end
 EMC_EXP int EMC_BIND emc_thread_join(emc_result_t ert);
 
+// Codec callback,returns the output length,0 when the output does not fit in cap
+typedef int emc_codec_cb(const char * src, int len, char * dst, int cap);
+// Register a compression codec for the tcp frames,both ends must register the same id.
+// Register before the devices are created,an id is registered once(EREBIND after)
+EMC_EXP int EMC_BIND emc_codec(int id, emc_codec_cb * compress, emc_codec_cb * decompress);
+
 // Message function definition.
 EMC_EXP void * EMC_BIND emc_msg_alloc(void * data, uint size);
 // Initialize the message structure
@@ -224,6 +261,9 @@ EMC_EXP int EMC_BIND emc_msg_length(void * msg);
 EMC_EXP int EMC_BIND emc_msg_free(void * msg);
 // Get the message buffer
 EMC_EXP void * EMC_BIND emc_msg_buffer(void * msg);
+// Allocate a message in the shared memory of an ipc plug,sent to ipc peers without being copied.
+// The buffer must not be written after sending,falls back to emc_msg_alloc when no block is free
+EMC_EXP void * EMC_BIND emc_msg_loan(int plug, uint size);
 
 
 // Equipment operation function definition
@@ -234,6 +274,9 @@ EMC_EXP void EMC_BIND emc_destory(int device);
 EMC_EXP int EMC_BIND emc_set(int device, int opt, void * optval, int optlen);
 
 EMC_EXP int EMC_BIND emc_plug(int device);
+// Set the plug's option,takes effect on the next emc_bind or emc_connect
+EMC_EXP int EMC_BIND emc_plug_set(int plug, int opt, void * optval, int optlen);
+// ip "unix:/path" or "unix:@name" binds or connects a unix socket instead,valid only for linux
 EMC_EXP int EMC_BIND emc_bind(int plug, const char * ip, const ushort port);
 EMC_EXP int EMC_BIND emc_connect(int plug, ushort mode, const char * ip, const ushort port);
 // Control plug,id is connected via monitor returns number.
@@ -242,6 +285,9 @@ EMC_EXP int EMC_BIND emc_close(int plug);
 // After processing is complete message needs to call emc_msg_free() to release.
 EMC_EXP int EMC_BIND emc_recv(int plug, void ** msg, int flag);
 EMC_EXP int EMC_BIND emc_send(int plug, void * msg, int flag);
+// Messages sent with EMC_NOWAIT still queued by the plug,emc_send fails with EAGAIN once the queue is full.
+// valid only for ipc
+EMC_EXP int EMC_BIND emc_plug_pending(int plug);
 
 // Monitoring the device event
 EMC_EXP int EMC_BIND emc_monitor(int device, struct monitor_data * data, int flag);
@@ -37,6 +37,7 @@
 #include "util/sendqueue.h"
 #include "util/map.h"
 #include "util/utility.h"
+#include "util/lock.h"
 #include "global.h"
 
 #define GLOBAL_DEVICE_DEFAULT	4096
@@ -64,6 +65,9 @@ struct global{
 	struct map			*rcmq;
 	// reconnect thread
 	emc_result_t		treconnect;
+	// Cpus of all the pinned devices,the reconnect thread runs on them
+	volatile uint64		affinity;
+	volatile uint		affinity_lck;
 	volatile uint		initialized;
 	// exit
 	volatile uint		exit;
@@ -84,7 +88,13 @@ static uint reconnect_map_foreach_cb(struct map * m, int64 key, void * p, void *
 }
 
 static emc_cb_t EMC_CALL  global_reconnect_cb(void * args){
+	uint64 affinity = 0;
 	while(!self.exit){
+		// Follow the devices pinned since the last pass
+		if(affinity != self.affinity){
+			affinity = self.affinity;
+			set_thread_affinity(affinity);
+		}
 		map_foreach(self.rcmq, reconnect_map_foreach_cb, NULL);
 		nsleep(100);
 	}
@@ -131,6 +141,12 @@ static void global_init(void){
 	}
 }
 
+void global_add_affinity(uint64 mask){
+	emc_lock(&self.affinity_lck);
+	self.affinity |= mask;
+	emc_unlock(&self.affinity_lck);
+}
+
 void global_term(void){
 	self.exit = 1;
 	emc_thread_join(self.treconnect);
@@ -241,6 +257,10 @@ int global_pop_sendqueue(int id, void ** p){
 	return sendqueue_pop(self.sq, id, p);
 }
 
+int global_empty_sendqueue(int id){
+	return sendqueue_empty(self.sq, id);
+}
+
 int global_add_reconnect(int id, on_reconnect_cb * cb, void * client, void * addition){
 	struct reconnect * rc = (struct reconnect *)malloc(sizeof(struct reconnect));
 	if(!rc)return -1;
@@ -265,7 +285,7 @@ void global_free_reconnect(int id){
 }
 
 void * global_alloc_monitor(){
-	return malloc(sizeof(struct monitor_data));
+	return calloc(1, sizeof(struct monitor_data));
 }
 
 void global_free_monitor(void *data){
@@ -60,12 +60,14 @@ void global_idle_connect_id(int id);
 int global_push_sendqueue(int id, void * p);
 int global_push_head_sendqueue(int id, void * p);
 int global_pop_sendqueue(int id, void ** p);
+int global_empty_sendqueue(int id);
 
 void *global_alloc_monitor();
 void global_free_monitor(void * data);
 
 int global_add_reconnect(int id, on_reconnect_cb *cb, void * client, void * addition);
 void global_free_reconnect(int id);
+void global_add_affinity(unsigned long long mask);
 
 int global_rand_number();
 
@@ -33,7 +33,6 @@
 #include "util/utility.h"
 #include "util/ringqueue.h"
 #include "util/ringbuffer.h"
-#include "util/ringarray.h"
 #include "util/lock.h"
 #include "global.h"
 #include "common.h"
@@ -42,13 +41,60 @@
 #include "msg.h"
 #include "ipc.h"
 
-#define IPC_HEAP_SIZE		(1024)
+// Initial size of the connection map,it grows with the clients
+#define IPC_MAP_SIZE		(8)
 
-// IPC server allows a maximum 8 ipc connection
-#define IPC_MAX_REMOTE		(8)
-
-#define IPC_BUFFER_SIZE		(0x90010C)
-#define IPC_PEER_SIZE		(0x100018)
+// Default record area of each ring,EMC_PLUG_IPC_RING
+#define IPC_RING_SIZE		(0x100000)
+#define IPC_RING_MIN		(0x4000)
+#define IPC_RING_MAX		(0x10000000)
+// Default loan heap of each peer,EMC_PLUG_IPC_HEAP
+#define IPC_LOAN_SIZE		(0x400000)
+// Header of a loaned block,the payload follows it
+#define IPC_BLOCK_HEAD		(16)
+// Default broadcast area of the server,EMC_PLUG_IPC_CAST.
+// A published message is written there once for all subscribers
+#define IPC_CAST_SIZE		(0x400000)
+#define IPC_CAST_PAD		(0xFFFFFFFF)
+// Layout of the regions,the version changes with it
+#define IPC_MAGIC			(0x454D4349)
+#define IPC_VERSION			(2)
+// Slots a receiver lists the loaned blocks it holds in,both sides of a connection keep theirs in the region of the client.
+// A slot is the offset of the block tagged in the high bits,the sender gives back what a peer that left still listed
+#define IPC_HELD_COUNT		(1024)
+#define IPC_HELD_CLIENT		(0)
+#define IPC_HELD_SERVER		(1)
+#define IPC_HELD_OFFSET		(0xFFFFFFFFFFFFLL)
+// Every peer owns a shared memory region,a heartbeat,the geometry,the doorbell,the space doorbell,the broadcast cursor,
+// the held slots and ring the peer reads,the ring a client sends its data to the server through and the heap the peer loans from.
+// The region of the server is named by the port and followed by the broadcast area,
+// each client creates its own with the geometry of the server before login
+#define IPC_HEAD_SIZE		(sizeof(int64) + sizeof(struct ipc_geometry) + 2 * sizeof(struct ipc_bell) + sizeof(struct ipc_cursor) + \
+							2 * IPC_HELD_COUNT * sizeof(int64))
+#define IPC_HEAP_OFFSET(g)	((IPC_HEAD_SIZE + 2 * get_ringbuffer_size((g)->ring) + 15) & ~15)
+#define IPC_PEER_SIZE(g)	(IPC_HEAP_OFFSET(g) + (g)->heap)
+#define IPC_SERVER_SIZE(g)	(IPC_PEER_SIZE(g) + sizeof(struct ipc_cast) + (g)->cast)
+#define IPC_GEOMETRY(peer)	((struct ipc_geometry *)((peer) + sizeof(int64)))
+#define IPC_BELL(peer)		((struct ipc_bell *)((char *)IPC_GEOMETRY(peer) + sizeof(struct ipc_geometry)))
+#define IPC_SPACE(peer)		(IPC_BELL(peer) + 1)
+#define IPC_CURSOR(peer)	((struct ipc_cursor *)(IPC_BELL(peer) + 2))
+#define IPC_HELD(peer, side)	((volatile int64 *)((char *)IPC_CURSOR(peer) + sizeof(struct ipc_cursor)) + (side) * IPC_HELD_COUNT)
+#define IPC_RING(peer)		((struct ringbuffer *)IPC_HELD(peer, 2))
+#define IPC_OUT_RING(peer, g)	((struct ringbuffer *)((char *)IPC_RING(peer) + get_ringbuffer_size((g)->ring)))
+#define IPC_HEAP(peer, g)	((peer) + IPC_HEAP_OFFSET(g))
+#define IPC_CAST(buffer, g)	((struct ipc_cast *)((buffer) + IPC_PEER_SIZE(g)))
+#define IPC_CAST_AREA(cast)	((char *)(cast) + sizeof(struct ipc_cast))
+// Data longer than a record is sent in fragments
+#define IPC_FRAGMENT_SIZE(g)	(get_ringbuffer_record((g)->ring) - sizeof(struct ipc_data_unit))
+// Doorbell checks before the reader parks
+#define IPC_SPIN			(4000)
+// Records taken from a ring before the next ring gets its turn
+#define IPC_BATCH			(64)
+// Messages sent with EMC_NOWAIT held for the send thread once the ring is full
+#define IPC_QUEUE_DEPTH		(1024)
+// Process of a peer sent at login,its pid and pid namespace
+#define IPC_PID_SIZE		(sizeof(int) + sizeof(uint64))
+#define IPC_LOGIN_SIZE		(sizeof(ushort) + sizeof(uint) + IPC_PID_SIZE)
 #define IPC_TIMEOUT			(5000)
 #define IPC_TASK_TIMEOUT	(60000)
 #define IPC_CHECK_TIMEOUT	(30000)
@@ -58,7 +104,16 @@ struct ipc_server{
 	volatile uint		term_lock;
 	// publish data lock
 	volatile uint		pub_lock;
+	// Lookup and removal of clients,a client looked up is held before it can be removed
+	volatile uint		conn_lock;
 	struct map			*connection;
+	// Clients whose rings the reader takes in turns,owned by the reader thread and each held
+	struct ipc_client	**polled;
+	uint				polled_count;
+	uint				polled_size;
+	// Where the commit cursor of the ring waits and since when,-1 not waiting
+	int64				pending;
+	int64				pending_time;
 };
 
 struct ipc_client{
@@ -68,22 +123,95 @@ struct ipc_client{
 	ushort				mode;
 	// Locally assigned id, for reconnection
 	int					inid;
-	// Serial connection
-	int					locate;
+	// Region of the peer mapped by this side
+	struct ipc_segment	*segment;
 	// Are already connected
 	volatile uint		connected;
 	// Last received data time 
 	volatile int64		time;
 
+	// Number naming the region of the client
 	uint				evt_flag;
-	// Transfer Handle
 #if defined (EMC_WINDOWS)
+	// Transfer Handle
 	HANDLE				evt;
 #else
-	int					evt;
+	// Process of the peer,readable once it exits
+	int					pidfd;
+	// Its number,the records it reserved on a ring are given up by it
+	int					pid;
 #endif
 	// Shared memory buffer address
 	char				*buffer;
+	// The map,the reader and the writers holding the client,the last one frees it.
+	// On a client,the writers in progress
+	volatile uint		ref;
+	// Left for good,the blocks it held and the loans it did not read are given back
+	volatile uint		reclaim;
+};
+
+// Region of a peer,kept while loaned messages point into it
+struct ipc_segment{
+	volatile uint		ref;
+#if defined (EMC_WINDOWS)
+	HANDLE				fd;
+#endif
+	size_t				size;
+	char				*buffer;
+};
+
+// Sizes of the regions,chosen when the server binds and read by the clients before they create their own
+struct ipc_geometry{
+	uint				magic;
+	uint				version;
+	// Record area of each ring
+	uint				ring;
+	// Loan heap of each peer
+	uint				heap;
+	// Broadcast area of the server
+	uint				cast;
+	uint				reserved;
+};
+
+// Doorbell of a ring,writers ring it after each push and
+// make a system call only when the reader has parked.
+// The space doorbell of a region is rung by the readers of its rings,sleeping counts the parked writers
+struct ipc_bell{
+	volatile uint		ring;
+	volatile uint		sleeping;
+};
+
+// Broadcast area header,written by the server only.
+// Records are {uint size,uint length} followed by a data unit and the data
+struct ipc_cast{
+	// End of the published records
+	volatile uint64		head;
+	// End of the record being written,a reader it laps has lost data
+	volatile uint64		reserve;
+};
+
+// Read position of a subscriber in the broadcast area
+struct ipc_cursor{
+	volatile uint64		position;
+	// Bytes skipped because the publisher lapped the subscriber
+	volatile uint64		lost;
+};
+
+// Loaned block in a peer heap
+struct ipc_block{
+	// Owner and receivers holding the block,0 it can be reused
+	volatile uint		ref;
+	// Block size,header included
+	uint				size;
+};
+
+// Block of a peer held by a message,the slot listing it is cleared by whoever gives the block back first
+struct ipc_hold{
+	// Region of the block,and region of the slot
+	struct ipc_segment	*segment;
+	struct ipc_segment	*list;
+	volatile int64		*slot;
+	int64				value;
 };
 
 struct ipc_data{
@@ -105,12 +233,22 @@ struct ipc{
 	HANDLE				fd;
 	// data event
 	HANDLE				evt;
+	// Region of a client
+	HANDLE				rfd;
 #else
+	// Region of the server,and of a client
 	int					fd;
-	int					evt;
+	int					rfd;
+	// Peer processes watched by the check thread
+	int					watch;
 #endif
-	// Shared memory buffer address
+	// Own region of the shared memory
 	char				*buffer;
+	// Own region of a client,the messages it holds over blocks of the server list them there
+	struct ipc_segment	*own;
+	struct ipc_geometry	geometry;
+	// Region of the server replaced at the last reconnection
+	struct ipc_segment	*retired;
 		
 	uint				ip;
 	ushort				port;
@@ -118,9 +256,21 @@ struct ipc{
 	emc_result_t		twork;
 	emc_result_t		tcheck;
 	emc_result_t		tsend;
-	//send data lock
+	// Send queue lock,the rings serialise the writers themselves
 	volatile uint		lock;
+	// Loan heap lock,allocation position and oldest block still in use
+	volatile uint		loan_lock;
+	uint64				loan_head;
+	uint64				loan_tail;
+	// Loaned blocks received,they tag the held slots
+	uint				held;
+	// Process of the server logged in to,blocks an earlier one held are given back when it changes
+	char				server_pid[IPC_PID_SIZE];
 	volatile uint		exit;
+	// Messages in the send queue,those being written included
+	volatile uint		queued;
+	// Copy of the broadcast record being read
+	char				*cast;
 	// Message received task list
 	struct map			*rmap;
 	// Send queue
@@ -131,59 +281,541 @@ struct ipc{
 };
 
 static int write_ipc_data(struct ipc * ipc_, struct ipc_client * client,
-	int id, ushort cmd, char * data, int length);
+	int id, ushort cmd, char * data, int length, int flag);
 static int reopen_ipc(struct ipc * ipc_);
+static int ipc_connect_server(struct ipc * ipc_);
+static int ipc_drain(struct ipc * ipc_, char * peer, struct ringbuffer * rb, int budget);
 
-static int ipc_read_wait(struct ipc * ipc_){
+//Cas Operate
+static uint ipc_number_cas(volatile uint * key, uint _old, uint _new){
 #if defined (EMC_WINDOWS)
-	if(WAIT_OBJECT_0 == WaitForSingleObject(ipc_->evt, INFINITE)){
+	return InterlockedCompareExchange((unsigned long*)key, _new, _old);
 #else
-	struct sembuf sem_b = {0, -1, 0};
-	if(0 == semop(ipc_->evt, &sem_b, 1)){
+	return __sync_val_compare_and_swap(key, _old, _new);
 #endif
-		return 0;
+}
+
+static int64 ipc_number_cas64(volatile int64 * key, int64 _old, int64 _new){
+#if defined (EMC_WINDOWS)
+	return InterlockedCompareExchange64((volatile LONGLONG *)key, _new, _old);
+#else
+	return __sync_val_compare_and_swap(key, _old, _new);
+#endif
+}
+
+// Returns the previous value
+static uint ipc_number_add(volatile uint * n, int v){
+	uint current = 0;
+	do{
+		current = *n;
+	}while(current != ipc_number_cas(n, current, current + v));
+	return current;
+}
+
+// Name of a shared memory region,flag 0 the region of the server
+static void ipc_region_name(char * name, ushort port, uint flag){
+#if defined (EMC_WINDOWS)
+	if(flag){
+		sprintf_s(name, PATH_LEN, "ipc_%ld_%ld", port, flag);
 	}else{
-#if !defined(EMC_WINDOWS)
-		if(EINTR == errno){
-			return 0;
+		sprintf_s(name, PATH_LEN, "ipc_%ld", port);
+	}
+#else
+	if(flag){
+		sprintf_s(name, PATH_LEN, "/emc_ipc_%d_%u", port, flag);
+	}else{
+		sprintf_s(name, PATH_LEN, "/emc_ipc_%d", port);
+	}
+#endif
+}
+
+#if !defined (EMC_WINDOWS)
+// Map a shared memory object,prefaulted and on transparent huge pages where the kernel allows.
+// Size 0 maps the whole object and returns its size
+static char * ipc_region_map(int fd, size_t * size){
+	struct stat st;
+	char * buffer = NULL;
+	if(fstat(fd, &st) < 0 || (size_t)st.st_size < *size || st.st_size <= 0) return NULL;
+	if(!*size){
+		*size = (size_t)st.st_size;
+	}
+	buffer = (char *)mmap(NULL, *size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+	if(MAP_FAILED == buffer) return NULL;
+#if defined (MADV_HUGEPAGE)
+	madvise(buffer, *size, MADV_HUGEPAGE);
+#endif
+	return buffer;
+}
+#endif
+
+// Map the whole region of a peer,flag 0 the region of the server
+static struct ipc_segment * ipc_segment_attach(struct ipc * ipc_, uint flag){
+#if defined (EMC_WINDOWS)
+	MEMORY_BASIC_INFORMATION mbi;
+#endif
+	char name[PATH_LEN] = {0};
+#if !defined (EMC_WINDOWS)
+	int fd = -1;
+#endif
+	struct ipc_segment * segment = (struct ipc_segment *)malloc(sizeof(struct ipc_segment));
+	if(!segment) return NULL;
+	segment->ref = 1;
+	ipc_region_name(name, ipc_->port, flag);
+#if defined (EMC_WINDOWS)
+	segment->fd = OpenFileMapping(FILE_MAP_READ|FILE_MAP_WRITE, TRUE, name);
+	if(!segment->fd){
+		free(segment);
+		return NULL;
+	}
+	segment->buffer = (char *)MapViewOfFile(segment->fd, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, 0);
+	if(!segment->buffer || !VirtualQuery(segment->buffer, &mbi, sizeof(mbi))){
+		if(segment->buffer){
+			UnmapViewOfFile(segment->buffer);
+		}
+		CloseHandle(segment->fd);
+		free(segment);
+		return NULL;
+	}
+	segment->size = mbi.RegionSize;
+#else
+	fd = shm_open(name, O_RDWR, 0666);
+	if(fd < 0){
+		free(segment);
+		return NULL;
+	}
+	segment->size = 0;
+	segment->buffer = ipc_region_map(fd, &segment->size);
+	close(fd);
+	if(!segment->buffer){
+		free(segment);
+		return NULL;
+	}
+#endif
+	return segment;
+}
+
+// Unmap a region once the connection and all loaned messages are gone
+static void ipc_segment_release(struct ipc_segment * segment){
+	if(!segment) return;
+	if(1 == ipc_number_add(&segment->ref, -1)){
+#if defined (EMC_WINDOWS)
+		UnmapViewOfFile(segment->buffer);
+		if(segment->fd){
+			CloseHandle(segment->fd);
 		}
+#else
+		munmap(segment->buffer, segment->size);
 #endif
+		free(segment);
 	}
-	return -1;
 }
 
-static int ipc_read_post(struct ipc_client * client){
+// Give a block of the own heap back,called when a message over it is freed
+static void ipc_loan_release(void * buffer, void * owner){
+	ipc_number_add(&((struct ipc_block *)((char *)buffer - IPC_BLOCK_HEAD))->ref, -1);
+}
+
+// Give a block of a peer back,unless the peer took it back already having counted this side gone
+static void ipc_loan_return(void * buffer, void * owner){
+	struct ipc_hold * hold = (struct ipc_hold *)owner;
+	if(hold->value == ipc_number_cas64(hold->slot, hold->value, 0)){
+		ipc_number_add(&((struct ipc_block *)((char *)buffer - IPC_BLOCK_HEAD))->ref, -1);
+	}
+	ipc_segment_release(hold->list);
+	ipc_segment_release(hold->segment);
+	free(hold);
+}
+
+static char * ipc_heap(struct ipc * ipc_){
+	if(!ipc_->buffer) return NULL;
+	return IPC_HEAP(ipc_->buffer, &ipc_->geometry);
+}
+
+// Whether data lies in a block of the own heap
+static int ipc_loaned(struct ipc * ipc_, char * data){
+	char * heap = ipc_heap(ipc_);
+	return heap && data >= heap + IPC_BLOCK_HEAD && data < heap + ipc_->geometry.heap;
+}
+
+// Only for a heap no block of which is out
+static void ipc_loan_reset(struct ipc * ipc_){
+	emc_lock(&ipc_->loan_lock);
+	ipc_->loan_head = ipc_->loan_tail = 0;
+	emc_unlock(&ipc_->loan_lock);
+}
+
+// Take a block from the own heap,blocks are handed out in ring order
+// and reused once the oldest ones are given back by every holder
+static void * ipc_loan_alloc(struct ipc * ipc_, uint size){
+	struct ipc_block * block = NULL;
+	char * heap = ipc_heap(ipc_);
+	uint64 need = (IPC_BLOCK_HEAD + (uint64)size + 15) & ~15, pos = 0, total = ipc_->geometry.heap;
+
+	if(!heap || need > total / 2) return NULL;
+	emc_lock(&ipc_->loan_lock);
+	while(ipc_->loan_tail != ipc_->loan_head){
+		block = (struct ipc_block *)(heap + ipc_->loan_tail % total);
+		if(block->ref) break;
+		ipc_->loan_tail += block->size;
+	}
+	pos = ipc_->loan_head % total;
+	if(total - pos < need){
+		// Skip the end of the lap so that a block is never split
+		if(ipc_->loan_head - ipc_->loan_tail + total - pos > total){
+			emc_unlock(&ipc_->loan_lock);
+			return NULL;
+		}
+		block = (struct ipc_block *)(heap + pos);
+		block->ref = 0;
+		block->size = (uint)(total - pos);
+		ipc_->loan_head += total - pos;
+		pos = 0;
+	}
+	if(ipc_->loan_head - ipc_->loan_tail + need > total){
+		emc_unlock(&ipc_->loan_lock);
+		return NULL;
+	}
+	block = (struct ipc_block *)(heap + pos);
+	block->ref = 1;
+	block->size = (uint)need;
+	ipc_->loan_head += need;
+	emc_unlock(&ipc_->loan_lock);
+	return (char *)block + IPC_BLOCK_HEAD;
+}
+
+// Give back a block of the own heap for a peer that left
+static void ipc_loan_put(struct ipc * ipc_, int64 offset){
+	struct ipc_geometry * g = &ipc_->geometry;
+	if(offset >= (int64)(IPC_HEAP_OFFSET(g) + IPC_BLOCK_HEAD) && offset < (int64)IPC_PEER_SIZE(g)){
+		ipc_number_add(&((struct ipc_block *)(ipc_->buffer + offset - IPC_BLOCK_HEAD))->ref, -1);
+	}
+}
+
+// Give back the blocks of the own heap a peer that left still held,
+// those listed in its slots and those in the records of a ring it will not read
+static void ipc_loan_reclaim(struct ipc * ipc_, volatile int64 * held, struct ringbuffer * rb){
+	void * data = NULL;
+	int64 value = 0;
+	uint index = 0;
+	int len = 0;
+
+	if(!ipc_heap(ipc_)) return;
+	for(index = 0; held && index < IPC_HELD_COUNT; index ++){
+		value = held[index];
+		if(value && value == ipc_number_cas64(&held[index], value, 0)){
+			ipc_loan_put(ipc_, value & IPC_HELD_OFFSET);
+		}
+	}
+	while(rb && (len = peek_ringbuffer(rb, &data)) >= 0){
+		if(len == sizeof(struct ipc_data_unit) + sizeof(int64) && EMC_CMD_LOAN == ((struct ipc_data_unit *)data)->cmd){
+			ipc_loan_put(ipc_, *(int64 *)((char *)data + sizeof(struct ipc_data_unit)));
+		}
+		pop_ringbuffer(rb);
+	}
+}
+
+// Message over a block loaned by the peer,the offset is checked to fall in the peer heap.
+// The block is listed in a held slot,with none free the data is copied and the block given back at once
+static void * ipc_loan_wrap(struct ipc * ipc_, struct ipc_segment * segment, char * peer,
+	struct ipc_segment * list, volatile int64 * held, int64 offset, int len){
+	struct ipc_geometry * g = &ipc_->geometry;
+	struct ipc_block * block = NULL;
+	struct ipc_hold * hold = NULL;
+	volatile int64 * slot = NULL;
+	void * msg = NULL;
+	uint index = 0;
+
+	if(!peer || !held || len < 0 || offset < (int64)(IPC_HEAP_OFFSET(g) + IPC_BLOCK_HEAD) || offset + len > (int64)IPC_PEER_SIZE(g)){
+		return NULL;
+	}
+	block = (struct ipc_block *)(peer + offset - IPC_BLOCK_HEAD);
+	hold = (struct ipc_hold *)malloc(sizeof(struct ipc_hold));
+	if(hold){
+		memset(hold, 0, sizeof(struct ipc_hold));
+		hold->value = offset | ((int64)(ipc_->held & 0xFFFF) << 48);
+		for(index = 0; index < IPC_HELD_COUNT && !hold->slot; index ++){
+			slot = held + (ipc_->held + index) % IPC_HELD_COUNT;
+			if(!*slot && 0 == ipc_number_cas64(slot, 0, hold->value)){
+				hold->slot = slot;
+			}
+		}
+		ipc_->held ++;
+	}
+	if(!hold || !hold->slot){
+		msg = emc_msg_alloc(peer + offset, len);
+		ipc_number_add(&block->ref, -1);
+		if(hold){
+			free(hold);
+		}
+		return msg;
+	}
+	hold->segment = segment;
+	hold->list = list;
+	if(segment){
+		ipc_number_add(&segment->ref, 1);
+	}
+	if(list){
+		ipc_number_add(&list->ref, 1);
+	}
+	msg = emc_msg_wrap(peer + offset, len, ipc_loan_return, hold);
+	if(!msg){
+		ipc_loan_return(peer + offset, hold);
+	}
+	return msg;
+}
+
+// Wait until the doorbell moves past ring,spinning briefly before parking
+static int ipc_read_wait(struct ipc * ipc_, uint ring){
+	struct ipc_bell * bell = IPC_BELL(ipc_->buffer);
+	int spin = 0;
+
+	for(spin = 0; spin < IPC_SPIN; spin ++){
+		if(ring != bell->ring) return 0;
+	}
+	bell->sleeping = 1;
+	emc_mb();
+	// A writer either sees the flag or rang before it was set
+	if(ring == bell->ring && !ipc_->exit){
+#if defined (EMC_WINDOWS)
+		WaitForSingleObject(ipc_->evt, INFINITE);
+#else
+		syscall(SYS_futex, &bell->ring, FUTEX_WAIT, ring, NULL, NULL, 0);
+#endif
+	}
+	bell->sleeping = 0;
+	return 0;
+}
+
+// Ring the doorbell of a peer region
+#if defined (EMC_WINDOWS)
+static int ipc_bell_ring(char * peer, HANDLE evt){
+#else
+static int ipc_bell_ring(char * peer){
+#endif
+	struct ipc_bell * bell = NULL;
+	if(!peer) return -1;
+	bell = IPC_BELL(peer);
+	ipc_number_add(&bell->ring, 1);
+	if(!bell->sleeping) return 0;
 #if defined (EMC_WINDOWS)
-	if(ReleaseSemaphore(client->evt, 1, NULL)){
+	if(ReleaseSemaphore(evt, 1, NULL)){
 #else
-	struct sembuf sem_b = {0, 1, 0};
-	if(0 == semop(client->evt, &sem_b, 1)){
+	if(syscall(SYS_futex, &bell->ring, FUTEX_WAKE, 1, NULL, NULL, 0) >= 0){
 #endif
 		return 0;
 	}
 	return -1;
 }
 
+static int ipc_read_post(struct ipc_client * client){
+#if defined (EMC_WINDOWS)
+	return ipc_bell_ring(client->buffer, client->evt);
+#else
+	return ipc_bell_ring(client->buffer);
+#endif
+}
+
 static int ipc_self_read_post(struct ipc * ipc_){
 #if defined (EMC_WINDOWS)
-	if(ReleaseSemaphore(ipc_->evt, 1, NULL)){
+	return ipc_bell_ring(ipc_->buffer, ipc_->evt);
 #else
-	struct sembuf sem_b = {0, 1, SEM_UNDO};
-	if(0 == semop(ipc_->evt, &sem_b, 1)){
+	return ipc_bell_ring(ipc_->buffer);
 #endif
-		return 0;
+}
+
+// Tell the writers parked on a full ring of the region that records were taken
+static void ipc_space_post(char * peer){
+	struct ipc_bell * bell = IPC_SPACE(peer);
+	ipc_number_add(&bell->ring, 1);
+#if !defined (EMC_WINDOWS)
+	if(bell->sleeping){
+		syscall(SYS_futex, &bell->ring, FUTEX_WAKE, 0x7FFFFFFF, NULL, NULL, 0);
 	}
-	return -1;
+#endif
+}
+
+// Wait until the space doorbell of a region moves past ring
+static void ipc_space_wait(char * peer, uint ring){
+#if defined (EMC_WINDOWS)
+	nsleep(1);
+#else
+	struct ipc_bell * bell = IPC_SPACE(peer);
+	// Bounded,a reader that is gone never rings
+	struct timespec ts = {0, 10000000};
+	ipc_number_add(&bell->sleeping, 1);
+	if(ring == bell->ring){
+		syscall(SYS_futex, &bell->ring, FUTEX_WAIT, ring, &ts, NULL, 0);
+	}
+	ipc_number_add(&bell->sleeping, -1);
+#endif
+}
+
+// Write the process of this side for the peer
+static void ipc_pid_write(char * data){
+#if defined (EMC_WINDOWS)
+	*(int *)data = (int)GetCurrentProcessId();
+	*(uint64 *)(data + sizeof(int)) = 0;
+#else
+	struct stat st;
+	*(int *)data = (int)getpid();
+	// Peers in other pid namespaces see another pid,they are left to the heartbeat
+	*(uint64 *)(data + sizeof(int)) = stat("/proc/self/ns/pid", &st) < 0 ? 0 : (uint64)st.st_ino;
+#endif
+}
+
+// Watch the process of a peer,its exit wakes the check thread at once
+static void ipc_watch_peer(struct ipc * ipc_, struct ipc_client * client, char * data, int len){
+#if !defined (EMC_WINDOWS)
+	char self[IPC_PID_SIZE] = {0};
+	struct epoll_event e = {0};
+	int fd = -1;
+
+	if(len < (int)IPC_PID_SIZE || ipc_->watch < 0) return;
+	ipc_pid_write(self);
+	if(*(int *)data <= 0 || !*(uint64 *)(data + sizeof(int)) ||
+		*(uint64 *)(data + sizeof(int)) != *(uint64 *)(self + sizeof(int))){
+		return;
+	}
+#if defined (SYS_pidfd_open)
+	fd = (int)syscall(SYS_pidfd_open, *(int *)data, 0);
+#endif
+	if(fd < 0) return;
+	e.events = EPOLLIN|EPOLLONESHOT;
+	if(epoll_ctl(ipc_->watch, EPOLL_CTL_ADD, fd, &e) < 0){
+		close(fd);
+		return;
+	}
+	client->pidfd = fd;
+	client->pid = *(int *)data;
+#endif
+}
+
+static void ipc_unwatch_peer(struct ipc_client * client){
+#if !defined (EMC_WINDOWS)
+	if(client->pidfd >= 0){
+		close(client->pidfd);
+		client->pidfd = -1;
+	}
+#endif
+}
+
+static void ipc_client_hold(struct ipc_client * client){
+	ipc_number_add(&client->ref, 1);
+}
+
+// Free a client once nothing holds it,its region is unmapped with it.
+// No writer is left on its ring,what a client that left held can be given back
+static void ipc_client_drop(struct ipc * ipc_, struct ipc_client * client){
+	if(1 != ipc_number_add(&client->ref, -1)) return;
+	if(client->reclaim && client->buffer){
+		ipc_loan_reclaim(ipc_, IPC_HELD(client->buffer, IPC_HELD_CLIENT), IPC_RING(client->buffer));
+	}
+	ipc_unwatch_peer(client);
+#if defined (EMC_WINDOWS)
+	if(client->evt){
+		CloseHandle(client->evt);
+	}
+#endif
+	ipc_segment_release(client->segment);
+	global_idle_connect_id(client->id);
+	free(client);
+}
+
+// Look a client up and hold it,it stays valid after it is taken out of the map
+static struct ipc_client * ipc_client_get(struct ipc * ipc_, int id){
+	struct ipc_client * client = NULL;
+	emc_lock(&ipc_->server->conn_lock);
+	if(0 == map_get(ipc_->server->connection, id, (void **)&client)){
+		ipc_client_hold(client);
+	}else{
+		client = NULL;
+	}
+	emc_unlock(&ipc_->server->conn_lock);
+	return client;
+}
+
+// Take a client out of the map,the caller gets the reference the map held
+static struct ipc_client * ipc_client_remove(struct ipc * ipc_, int id){
+	struct ipc_client * client = NULL;
+	emc_lock(&ipc_->server->conn_lock);
+	if(map_get(ipc_->server->connection, id, (void **)&client) < 0 || map_erase(ipc_->server->connection, id) < 0){
+		client = NULL;
+	}
+	emc_unlock(&ipc_->server->conn_lock);
+	return client;
+}
+
+// Put a removed client out of service,writers parked on its ring give up
+// and the reader lets it go on its next pass
+static void ipc_client_retire(struct ipc * ipc_, struct ipc_client * client){
+	client->connected = 0;
+	ipc_space_post(client->buffer);
+	ipc_self_read_post(ipc_);
+	ipc_client_drop(ipc_, client);
+}
+
+// Hand the reader a new client,called on the reader thread only
+static int ipc_poll_add(struct ipc_server * server, struct ipc_client * client){
+	if(server->polled_count == server->polled_size){
+		uint size = server->polled_size ? server->polled_size << 1 : IPC_MAP_SIZE;
+		struct ipc_client ** polled = (struct ipc_client **)realloc(server->polled, size * sizeof(struct ipc_client *));
+		if(!polled) return -1;
+		server->polled = polled;
+		server->polled_size = size;
+	}
+	ipc_client_hold(client);
+	server->polled[server->polled_count ++] = client;
+	return 0;
+}
+
+// Whether the watched process of the peer has exited
+static int ipc_peer_gone(struct ipc_client * client){
+#if defined (EMC_WINDOWS)
+	return 0;
+#else
+	struct pollfd pfd = {0};
+	if(client->pidfd < 0) return 0;
+	pfd.fd = client->pidfd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0;
+#endif
+}
+
+// Whether a process of this pid namespace has exited
+static int ipc_pid_gone(int pid){
+#if defined (EMC_WINDOWS)
+	return 0;
+#else
+	return pid > 0 && kill(pid, 0) < 0 && ESRCH == errno;
+#endif
+}
+
+// Sleep for the period,a watched peer exiting ends it early
+static void ipc_watch_wait(struct ipc * ipc_, int timeout){
+#if defined (EMC_WINDOWS)
+	nsleep(timeout);
+#else
+	struct epoll_event e[16];
+	if(ipc_->watch < 0 || epoll_wait(ipc_->watch, e, 16, timeout) < 0){
+		nsleep(timeout);
+	}
+#endif
 }
 
 // Login packet sent to the server
-static int  ipc_send_register(struct ipc * ipc_, char * data, int len){	
-	return write_ipc_data(ipc_, ipc_->client, -1, EMC_CMD_LOGIN, data, len);
+static int  ipc_send_register(struct ipc * ipc_){	
+	char buffer[IPC_LOGIN_SIZE] = {0};
+	*(ushort *)buffer = ipc_->client->mode;
+	*(uint *)(buffer + sizeof(ushort)) = ipc_->client->evt_flag;
+	ipc_pid_write(buffer + sizeof(ushort) + sizeof(uint));
+	return write_ipc_data(ipc_, ipc_->client, -1, EMC_CMD_LOGIN, buffer, IPC_LOGIN_SIZE, 0);
 }
 
 // Send registration response packet to the client
 static int ipc_send_register_bc(struct ipc * ipc_, struct ipc_client * client){
-	return write_ipc_data(ipc_, client, client->id, EMC_CMD_LOGIN, NULL, 0 );
+	char buffer[IPC_PID_SIZE] = {0};
+	ipc_pid_write(buffer);
+	return write_ipc_data(ipc_, client, client->id, EMC_CMD_LOGIN, buffer, IPC_PID_SIZE, 0);
 }
 
 // delete all recv task unit
@@ -227,70 +859,74 @@ static void ipc_complete_data(struct ipc * ipc_, int id, ushort cmd, char * data
 
 	if(EMC_CMD_LOGIN == cmd){
 		if(EMC_LOCAL == ipc_->type){
+#if defined (EMC_WINDOWS)
 			char name[PATH_LEN] = {0};
+#endif
 			ushort mode = *(ushort *)data;
 
 			// Process new ipc connections
 			client = (struct ipc_client *)malloc(sizeof(struct ipc_client));
 			if(client){
+				memset(client, 0, sizeof(struct ipc_client));
+				// Until it is in the map the client is held here only
+				client->ref = 1;
 				client->mode = mode;
 				client->id = global_get_connect_id();
 				client->evt_flag = *(uint *)(data + sizeof(ushort));
+#if !defined (EMC_WINDOWS)
+				client->pidfd = -1;
+#endif
 #if defined (EMC_WINDOWS)
 				sprintf_s(name, PATH_LEN, "event_%ld_%ld", ipc_->port, *(uint *)(data + sizeof(ushort)));
 				client->evt = OpenSemaphore(SEMAPHORE_ALL_ACCESS, TRUE, name);
 				if(!client->evt){
-					global_idle_connect_id(client->id);
-					free(client);
+					ipc_client_drop(ipc_, client);
 					return;
 				}
-#else
-				client->evt = semget(*(uint *)(data + sizeof(ushort)), 0, IPC_CREAT|0600);
-				if(client->evt<0){
-					global_idle_connect_id(client->id);
-					free(client);
-					return ;
-				}
-#endif
-				client->locate = *(int *)(data + sizeof(ushort) + sizeof(uint));
-				if(client->locate < 0 || client->locate >= IPC_MAX_REMOTE){
-#if defined (EMC_WINDOWS)
-					CloseHandle(client->evt);
-#else
-					semctl(client->evt, 0, IPC_RMID, NULL);
 #endif
+				client->segment = ipc_segment_attach(ipc_, client->evt_flag);
+				// The region of the client must have been laid out with the geometry of the server
+				if(client->segment && (client->segment->size < IPC_PEER_SIZE(&ipc_->geometry) ||
+					memcmp(IPC_GEOMETRY(client->segment->buffer), &ipc_->geometry, sizeof(struct ipc_geometry)))){
+					ipc_segment_release(client->segment);
+					client->segment = NULL;
+				}
+				if(!client->segment){
+					ipc_client_drop(ipc_, client);
 					return;
 				}
-				client->buffer = ipc_->buffer + sizeof(uint) + get_ringarray_size() + (client->locate + 1) * IPC_PEER_SIZE;
+				client->buffer = client->segment->buffer;
 				// Send to respond to the client
 				if(ipc_send_register_bc(ipc_, client) < 0){
-					global_idle_connect_id(client->id);
-#if defined (EMC_WINDOWS)
-					CloseHandle(client->evt);
-#else
-					semctl(client->evt, 0, IPC_RMID, NULL);
-#endif
-					free(client);
-				}else{
-					client->connected = 1;
-					client->time = time_get_time();
-					if(map_add(ipc_->server->connection, client->id, client) < 0){
-						client->connected = 0;
-						global_idle_connect_id(client->id);
-#if defined (EMC_WINDOWS)
-						CloseHandle(client->evt);
-#else
-						semctl(client->evt, 0, IPC_RMID, NULL);
-#endif
-						free(client);
-					}
+					ipc_client_drop(ipc_, client);
+					return;
 				}
+				client->connected = 1;
+				client->time = time_get_time();
+				ipc_watch_peer(ipc_, client, data + sizeof(ushort) + sizeof(uint), len - (int)(sizeof(ushort) + sizeof(uint)));
 				// If you set the monitor to throw on accept events
-				ipc_post_monitor(ipc_,client, (int)client->evt, EMC_EVENT_ACCEPT, NULL);
+				ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_ACCEPT, NULL);
+				if(ipc_poll_add(ipc_->server, client) < 0){
+					ipc_client_drop(ipc_, client);
+					return;
+				}
+				// Once in the map the client may be removed by another thread at any time
+				if(map_add(ipc_->server->connection, client->id, client) < 0){
+					client->connected = 0;
+					ipc_client_drop(ipc_, client);
+				}
 			}
 		}else if(EMC_REMOTE == ipc_->type){
 			// Processing ipc server response id number
 			ipc_->client->id = id;
+			// Another server answers,the blocks an earlier one held are not given back by it
+			if(len >= (int)IPC_PID_SIZE && memcmp(ipc_->server_pid, data, IPC_PID_SIZE)){
+				ipc_loan_reclaim(ipc_, IPC_HELD(ipc_->buffer, IPC_HELD_SERVER), NULL);
+				memcpy(ipc_->server_pid, data, IPC_PID_SIZE);
+			}
+			ipc_watch_peer(ipc_, ipc_->client, data, len);
+			// A subscriber gets what is published from now on
+			IPC_CURSOR(ipc_->buffer)->position = IPC_CAST(ipc_->client->buffer, &ipc_->geometry)->head;
 			ipc_->client->connected = 1;
 			ipc_->reconnect = NULL;
 			if(ipc_->client->inid >= 0){
@@ -298,53 +934,51 @@ static void ipc_complete_data(struct ipc * ipc_, int id, ushort cmd, char * data
 				ipc_->client->inid = -1;
 			}
 			// If you set the monitor to throw on connect events
-			ipc_post_monitor(ipc_, ipc_->client, (int)ipc_->fd, EMC_EVENT_CONNECT, NULL);
+			ipc_post_monitor(ipc_, ipc_->client, ipc_->port, EMC_EVENT_CONNECT, NULL);
 		}
 	}else if(EMC_CMD_LOGOUT == cmd){
 		if(EMC_LOCAL == ipc_->type){
-			if(0 == map_get(ipc_->server->connection, id, (void **)&client)){
-				client->connected = 0;
+			client = ipc_client_remove(ipc_, id);
+			if(client){
+				client->reclaim = 1;
+				// Data the client sent before leaving is still delivered
+				ipc_drain(ipc_, client->buffer, IPC_OUT_RING(client->buffer, &ipc_->geometry), 0x7FFFFFFF);
 				emc_lock(&ipc_->server->term_lock);
 				map_foreach(ipc_->rmap, ipc_tq_foreach_cb, client);
 				// If you set the monitor to throw on disconnect events
-				ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_CLOSED, NULL);
-#if defined (EMC_WINDOWS)
-				if(client->evt){
-					CloseHandle(client->evt);
-					client->evt = NULL;
-				}
-#else
-				close(client->evt);
-				client->evt = -1;
-#endif
-				if(0 == map_erase(ipc_->server->connection, id)){
-					push_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), client->locate);
-					global_idle_connect_id(id);
-					free(client);
-				}
+				ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_CLOSED, NULL);
+				ipc_client_retire(ipc_, client);
 				emc_unlock(&ipc_->server->term_lock);
 			}
 		}else if(EMC_REMOTE == ipc_->type){
 			ipc_->client->connected = 0;
 			map_foreach(ipc_->rmap, ipc_tq_foreach_cb, ipc_->client);
 		}
-	}else if(EMC_CMD_DATA == cmd){
-		msg = emc_msg_alloc(data, len);
+	}else if(EMC_CMD_DATA == cmd || EMC_CMD_LOAN == cmd){
 		if(EMC_LOCAL == ipc_->type){
 			if(0 == map_get(ipc_->server->connection, id, (void **)&client)){
 				client->time = time_get_time();
+				if(EMC_CMD_LOAN == cmd){
+					msg = ipc_loan_wrap(ipc_, client->segment, client->buffer, client->segment,
+						IPC_HELD(client->buffer, IPC_HELD_SERVER), *(int64 *)data, len);
+				}else{
+					msg = emc_msg_alloc(data, len);
+				}
 				if(msg){
 					emc_msg_setid(msg, id);
 					emc_msg_set_mode(msg, client->mode);
 				}
-			}else{
-				emc_msg_free(msg);
-				msg = NULL;
 			}
 		}else if(EMC_REMOTE == ipc_->type){
 			ipc_->client->time = time_get_time();
+			if(EMC_CMD_LOAN == cmd){
+				msg = ipc_loan_wrap(ipc_, ipc_->client->segment, ipc_->client->buffer, ipc_->own,
+					ipc_->own ? IPC_HELD(ipc_->buffer, IPC_HELD_CLIENT) : NULL, *(int64 *)data, len);
+			}else{
+				msg = emc_msg_alloc(data, len);
+			}
 			if(msg){
-				emc_msg_setid(msg, id);
+				emc_msg_setid(msg, ipc_->client->id);
 				emc_msg_set_mode(msg, get_plug_mode(ipc_->plug));
 			}
 		}
@@ -361,63 +995,78 @@ static void ipc_merger_cb(char * data, int len, int id, void * addition){
 	ipc_complete_data((struct ipc *)addition, id, EMC_CMD_DATA, data, len);
 }
 
+// The threads are gone,the map lets its references go
 static uint ipc_term_foreach_cb(struct map * m, int64 key, void * p, void * addition){
-	struct ipc_client * client = (struct ipc_client *)p;
-#if defined (EMC_WINDOWS)
-	if(client->evt){
-		CloseHandle(client->evt);
-		client->evt = NULL;
-	}
-#else
-	if(client->evt >= 0){
-		close(client->evt);
-	}
-#endif
+	ipc_client_drop((struct ipc *)addition, (struct ipc_client *)p);
 	return 0;
 }
 
 static void term_ipc(struct ipc * ipc_){
+#if !defined (EMC_WINDOWS)
+	char name[PATH_LEN] = {0};
+#endif
+	if(EMC_REMOTE == ipc_->type){
+		ipc_unwatch_peer(ipc_->client);
+		ipc_segment_release(ipc_->client->segment);
+		ipc_segment_release(ipc_->retired);
+		ipc_->client->segment = ipc_->retired = NULL;
+		ipc_->client->buffer = NULL;
+		if(ipc_->own){
+			ipc_segment_release(ipc_->own);
+			ipc_->own = NULL;
+			ipc_->buffer = NULL;
+		}
+	}
 #if defined (EMC_WINDOWS)
 	if(ipc_->buffer){
-		if(EMC_LOCAL == ipc_->type){
-			UnmapViewOfFile(ipc_->buffer);
-		}else if(EMC_REMOTE == ipc_->type){
-			UnmapViewOfFile(ipc_->client->buffer);
-		}
+		UnmapViewOfFile(ipc_->buffer);
 		ipc_->buffer = NULL;
 	}
 	if(ipc_->fd){
 		CloseHandle(ipc_->fd);
 		ipc_->fd = NULL;
 	}
+	if(ipc_->rfd){
+		CloseHandle(ipc_->rfd);
+		ipc_->rfd = NULL;
+	}
 	if(ipc_->evt){
 		CloseHandle(ipc_->evt);
 		ipc_->evt = NULL;
 	}
 #else
-	struct shmid_ds mds;
-	if(EMC_LOCAL == ipc_->type){
-		shmdt(ipc_->buffer);
+	if(ipc_->buffer){
+		munmap(ipc_->buffer, EMC_LOCAL == ipc_->type ? IPC_SERVER_SIZE(&ipc_->geometry) : IPC_PEER_SIZE(&ipc_->geometry));
 		ipc_->buffer = NULL;
-	}else if(EMC_REMOTE == ipc_->type){
-		shmdt(ipc_->client->buffer);
-		ipc_->client->buffer = NULL;
 	}
-	if(0 == shmctl(ipc_->fd, IPC_STAT, &mds)){
-		if(mds.shm_nattch <= 0){
-			shmctl(ipc_->fd, IPC_RMID, NULL);
-			ipc_->fd = -1;
-			if(EMC_REMOTE == ipc_->type){
-				semctl(ipc_->client->evt, IPC_RMID, NULL);
-				ipc_->evt = -1;
-			}
-		}
+	// The names go at once,peers still mapping a region keep it until they unmap
+	if(ipc_->fd >= 0){
+		close(ipc_->fd);
+		ipc_->fd = -1;
+		ipc_region_name(name, ipc_->port, 0);
+		shm_unlink(name);
+	}
+	if(ipc_->rfd >= 0){
+		close(ipc_->rfd);
+		ipc_->rfd = -1;
+		ipc_region_name(name, ipc_->port, ipc_->client->evt_flag);
+		shm_unlink(name);
+	}
+	if(ipc_->watch >= 0){
+		close(ipc_->watch);
+		ipc_->watch = -1;
 	}
-	semctl(ipc_->evt , 0, IPC_RMID, NULL);
-	ipc_->evt = -1;
 #endif
 	if(EMC_LOCAL == ipc_->type){
 		map_foreach(ipc_->server->connection, ipc_term_foreach_cb, ipc_);
+		while(ipc_->server->polled_count){
+			ipc_client_drop(ipc_, ipc_->server->polled[-- ipc_->server->polled_count]);
+		}
+		if(ipc_->server->polled){
+			free(ipc_->server->polled);
+			ipc_->server->polled = NULL;
+		}
+		ipc_->server->polled_size = 0;
 	}else if(EMC_REMOTE == ipc_->type){
 #if defined (EMC_WINDOWS)
 		if(ipc_->client->evt){
@@ -428,125 +1077,59 @@ static void term_ipc(struct ipc * ipc_){
 	}
 }
 
-static int reopen_ipc(struct ipc * ipc_){
-	char buffer[2 * sizeof(uint) + sizeof(ushort)] = {0};
+// Map the region of the server,a restarted server may have created it anew
+static int ipc_attach_server(struct ipc * ipc_){
+#if defined (EMC_WINDOWS)
+	char name[PATH_LEN] = {0};
+#endif
+	struct ipc_segment * segment = ipc_segment_attach(ipc_, 0);
+	if(!segment){
+		return -1;
+	}
+	// The threads may still be on the old region,it is kept until the next reconnection
+	ipc_segment_release(ipc_->retired);
+	ipc_->retired = ipc_->client->segment;
+	ipc_->client->segment = segment;
+	ipc_->client->buffer = segment->buffer;
+#if defined (EMC_WINDOWS)
+	if(ipc_->client->evt){
+		CloseHandle(ipc_->client->evt);
+		ipc_->client->evt = NULL;
+	}
+	sprintf_s(name, PATH_LEN, "event_%ld", ipc_->port);
+	ipc_->client->evt = OpenSemaphore(SEMAPHORE_ALL_ACCESS, TRUE, name);
+	if(!ipc_->client->evt){
+		return -1;
+	}
+#endif
+	return 0;
+}
 
+static int reopen_ipc(struct ipc * ipc_){
 	if(EMC_REMOTE == ipc_->type){
-#if defined (EMC_WINDOWS)
-		char name[PATH_LEN] = {0};
-		if(ipc_->client->id >= 0){
-			// If you set the monitor to throw on disconnect events
-			ipc_post_monitor(ipc_,ipc_->client, (int)ipc_->fd, EMC_EVENT_CLOSED, NULL);
-			ipc_->client->id = -1;
-		}
-		ipc_->client->connected = 0;
-		if(ipc_->client->evt){
-			CloseHandle(ipc_->client->evt);
-			ipc_->client->evt = NULL;
-		}
-		if(!ipc_->fd){
-			sprintf_s(name, PATH_LEN, "ipc_%ld", ipc_->port);
-			ipc_->fd = OpenFileMapping(FILE_MAP_READ|FILE_MAP_WRITE,TRUE, name);
-			if(!ipc_->fd){
-				return -1;
-			}
-			ipc_->client->buffer = ipc_->buffer = (char *)MapViewOfFile(ipc_->fd, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, 0);
-			if(!ipc_->buffer){
-				CloseHandle(ipc_->fd);
-				ipc_->fd = NULL;
-				return -1;
-			}
-			ipc_->client->locate = -1;
-			if(pop_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), (void *)&ipc_->client->locate) < 0){
-				UnmapViewOfFile(ipc_->buffer);
-				CloseHandle(ipc_->fd);
-				ipc_->buffer = NULL;
-				ipc_->fd = NULL;
-				return -1;
-			}
-			if(ipc_->client->locate < 0){
-				UnmapViewOfFile(ipc_->buffer);
-				CloseHandle(ipc_->fd);
-				ipc_->buffer = NULL;
-				ipc_->fd = NULL;
-				return -1;
-			}
-			ipc_->buffer = ipc_->buffer + sizeof(uint) + get_ringarray_size() + IPC_PEER_SIZE * (ipc_->client->locate + 1);
-		}
-		sprintf_s(name, PATH_LEN, "event_%ld", ipc_->port);
-		ipc_->client->evt = OpenSemaphore(SEMAPHORE_ALL_ACCESS, TRUE, name);
-		if(!ipc_->client->evt){
-			return -1;
-		}
-		if(ipc_->buffer){
-			*(int64 *)ipc_->buffer = time_get_time();
-		}
-		*(int *)(buffer + sizeof(ushort) + sizeof(uint)) = ipc_->client->locate;
-		init_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(int64)));
-#else
 		if(ipc_->client->id >= 0){
 			// If you set the monitor to throw on disconnect events
-			ipc_post_monitor(ipc_, ipc_->client, (int)ipc_->fd, EMC_EVENT_CLOSED, NULL);
+			ipc_post_monitor(ipc_, ipc_->client, ipc_->port, EMC_EVENT_CLOSED, NULL);
 			ipc_->client->id = -1;
 		}
 		ipc_->client->connected = 0;
-		if(ipc_->client->evt >= 0){
-			semctl(ipc_->client->evt, 0, IPC_RMID, NULL);
-			ipc_->client->evt = -1;
-		}
-		if(ipc_->fd < 0){
-			ipc_->fd = shmget(ipc_->port, 0, IPC_CREAT|0666);
-			if(ipc_->fd<0){
-				return -1;
-			}
-			ipc_->client->buffer = ipc_->buffer = (char *)shmat(ipc_->fd, NULL, 0);
-			if(!ipc_->buffer){
-				shmctl(ipc_->fd, IPC_RMID, NULL);
-				ipc_->fd = -1;
-				return -1;
-			}
-			ipc_->client->locate = -1;
-			if(pop_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)),(void *)&ipc_->client->locate) < 0){
-				shmdt(ipc_->buffer);
-				ipc_->buffer = NULL;
-				close(ipc_->fd);
-				semctl(ipc_->evt, IPC_RMID, NULL);
-				ipc_->fd = -1;
-				return -1;
-			}
-			if(ipc_->client->locate < 0){
-				shmdt(ipc_->buffer);
-				ipc_->buffer = NULL;
-				close(ipc_->fd);
-				semctl(ipc_->evt, IPC_RMID, NULL);
-				ipc_->fd = -1;
-				return -1;
-			}
-			ipc_->buffer = ipc_->buffer + sizeof(uint) + get_ringarray_size() + IPC_PEER_SIZE * (ipc_->client->locate + 1);
-		}
-		ipc_->client->evt = semget(ipc_->port+0xFFFF, 0, IPC_CREAT|0600);
-		if(ipc_->client->evt<0){
-			return -1;
-		}
-		if(ipc_->buffer){
-			*(int64 *)ipc_->buffer = time_get_time();
-		}
-		*(int *)(buffer + sizeof(ushort) + sizeof(uint)) = ipc_->client->locate;
-		init_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(int64)));
-#endif
-		// Login packet sent to the server
-		*(ushort *)buffer = ipc_->client->mode;
-		*(uint *)(buffer + sizeof(ushort)) = ipc_->client->evt_flag;
-		*(int *)(buffer + sizeof(ushort) + sizeof(uint)) = ipc_->client->locate;
-		if(ipc_send_register(ipc_, buffer, 2 * sizeof(uint) + sizeof(ushort)) < 0){
+		ipc_unwatch_peer(ipc_->client);
+		if(ipc_connect_server(ipc_) < 0){
 			return -1;
 		}
 	}
 	return 0;
 }
 
-static int process_ipc_data(struct ipc * ipc_, char * data){
-	if(((struct ipc_data_unit *)data)->total <= IPC_DATA_SIZE){
+static int process_ipc_data(struct ipc * ipc_, char * data, int len){
+	if(len < (int)sizeof(struct ipc_data_unit)) return -1;
+	if(EMC_CMD_LOAN == ((struct ipc_data_unit *)data)->cmd){
+		// A loaned block,the record holds its offset
+		if(len != sizeof(struct ipc_data_unit) + sizeof(int64)) return -1;
+		ipc_complete_data(ipc_, ((struct ipc_data_unit *)data)->id, EMC_CMD_LOAN, data + sizeof(struct ipc_data_unit),
+			((struct ipc_data_unit *)data)->total);
+	}else if(0 == ((struct ipc_data_unit *)data)->no && ((struct ipc_data_unit *)data)->total == len - sizeof(struct ipc_data_unit)){
+		// A whole message in one record
 		ipc_complete_data(ipc_, ((struct ipc_data_unit *)data)->id, ((struct ipc_data_unit *)data)->cmd, data + sizeof(struct ipc_data_unit),
 			((struct ipc_data_unit *)data)->total);
 	}else{
@@ -555,8 +1138,8 @@ static int process_ipc_data(struct ipc * ipc_, char * data){
 		union data_serial serial = {0};
 		serial.id = ((struct ipc_data_unit *)data)->id;
 		serial.serial = ((struct ipc_data_unit *)data)->serial;
-		packets = ((struct ipc_data_unit *)data)->total / IPC_DATA_SIZE;
-		if(((struct ipc_data_unit *)data)->total % IPC_DATA_SIZE){
+		packets = ((struct ipc_data_unit *)data)->total / IPC_FRAGMENT_SIZE(&ipc_->geometry);
+		if(((struct ipc_data_unit *)data)->total % IPC_FRAGMENT_SIZE(&ipc_->geometry)){
 			packets ++;
 		}
 		if(map_get(ipc_->rmap, serial.no, (void **)&mg) < 0){
@@ -566,11 +1149,9 @@ static int process_ipc_data(struct ipc * ipc_, char * data){
 			map_add(ipc_->rmap, serial.no, mg);
 		}
 		if(mg){
-			int length = ((struct ipc_data_unit *)data)->no < (packets - 1)?IPC_DATA_SIZE:
-				(((struct ipc_data_unit *)data)->total - (packets - 1) * IPC_DATA_SIZE);
 			merger_add(mg, ((struct ipc_data_unit *)data)->no,
-				((struct ipc_data_unit *)data)->no * IPC_DATA_SIZE, 
-				data + sizeof(struct ipc_data_unit), length);
+				((struct ipc_data_unit *)data)->no * IPC_FRAGMENT_SIZE(&ipc_->geometry), 
+				data + sizeof(struct ipc_data_unit), len - sizeof(struct ipc_data_unit));
 			if(0 == merger_get(mg, ipc_merger_cb, ((struct ipc_data_unit *)data)->id, ipc_)){
 				global_free_merger(mg);
 				map_erase(ipc_->rmap, serial.no);
@@ -580,123 +1161,276 @@ static int process_ipc_data(struct ipc * ipc_, char * data){
 	return 0;
 }
 
-static int read_ipc(struct ipc * ipc_){
-	char buffer[MAX_DATA_SIZE] = {0};
-	if(!ipc_) return -1;
-	
-	if(0==ipc_read_wait(ipc_)){
-		if(!ipc_->buffer) return -1;
-		if(EMC_LOCAL == ipc_->type){
-			while(0 == pop_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(uint) + sizeof(int64) + get_ringarray_size()), buffer)){
-				process_ipc_data(ipc_, buffer);
-			}
-		}else{
-			while(0 == pop_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(int64)), buffer)){
-				process_ipc_data(ipc_, buffer);
-			}
+// Records are handled in place and released once copied out
+static int ipc_drain(struct ipc * ipc_, char * peer, struct ringbuffer * rb, int budget){
+	void * data = NULL;
+	int len = 0, count = 0;
+	while(count < budget && (len = peek_ringbuffer(rb, &data)) >= 0){
+		process_ipc_data(ipc_, (char *)data, len);
+		pop_ringbuffer(rb);
+		count ++;
+	}
+	if(count > 0){
+		ipc_space_post(peer);
+	}
+	return count;
+}
+
+// Each client has its own ring to the server,they are taken in turns.
+// The reader holds the clients itself,those taken out of service are let go here
+static int ipc_poll_clients(struct ipc * ipc_){
+	struct ipc_server * server = ipc_->server;
+	struct ipc_client * client = NULL;
+	uint index = 0;
+	int count = 0;
+
+	while(index < server->polled_count){
+		client = server->polled[index];
+		if(!client->connected){
+			server->polled[index] = server->polled[-- server->polled_count];
+			ipc_client_drop(ipc_, client);
+			continue;
+		}
+		count += ipc_drain(ipc_, client->buffer, IPC_OUT_RING(client->buffer, &ipc_->geometry), IPC_BATCH);
+		index ++;
+	}
+	return count;
+}
+
+// Copy the records published since the cursor,a subscriber lapped by the publisher skips to the newest
+static int ipc_cast_drain(struct ipc * ipc_){
+	struct ipc_cast * cast = IPC_CAST(ipc_->client->buffer, &ipc_->geometry);
+	struct ipc_cursor * cursor = IPC_CURSOR(ipc_->buffer);
+	char * area = IPC_CAST_AREA(cast);
+	uint64 position = cursor->position, pos = 0, total = ipc_->geometry.cast;
+	uint size = 0, len = 0;
+	int count = 0, valid = 0;
+
+	if(!ipc_->cast){
+		ipc_->cast = (char *)malloc(total / 2);
+		if(!ipc_->cast) return 0;
+	}
+	while(count < IPC_BATCH && position != cast->head){
+		emc_mb();
+		pos = position % total;
+		size = *(uint *)(area + pos);
+		len = *(uint *)(area + pos + sizeof(uint));
+		valid = cast->head - position <= total && !(size & 7) && size >= 2 * sizeof(uint) && size <= total - pos;
+		if(valid && IPC_CAST_PAD != len){
+			valid = len <= size - 2 * sizeof(uint) && len <= total / 2;
+			if(valid){
+				memcpy(ipc_->cast, area + pos + 2 * sizeof(uint), len);
+			}
+		}
+		emc_mb();
+		// The copy only counts when the publisher did not write over it meanwhile
+		if(!valid || cast->reserve - position > total){
+			cursor->lost += cast->head - position;
+			position = cast->head;
+			continue;
+		}
+		position += size;
+		if(IPC_CAST_PAD != len){
+			process_ipc_data(ipc_, ipc_->cast, len);
+			count ++;
+		}
+	}
+	cursor->position = position;
+	return count;
+}
+
+static int read_ipc(struct ipc * ipc_){
+	uint ring = 0;
+	int count = 0;
+	if(!ipc_) return -1;
+	if(!ipc_->buffer){
+		nsleep(10);
+		return -1;
+	}
+	// Read the doorbell first,a record pushed after the drain moves it
+	ring = IPC_BELL(ipc_->buffer)->ring;
+	count = ipc_drain(ipc_, ipc_->buffer, IPC_RING(ipc_->buffer), IPC_BATCH);
+	if(EMC_LOCAL == ipc_->type){
+		count += ipc_poll_clients(ipc_);
+	}else if(EMC_SUB == ipc_->client->mode && ipc_->client->connected && ipc_->client->buffer){
+		count += ipc_cast_drain(ipc_);
+	}
+	// Rings left with records are taken again before parking
+	if(count > 0) return 0;
+	return ipc_read_wait(ipc_, ring);
+}
+
+// Push a record,parking on the space doorbell of the region while the ring is full
+static int ipc_push(struct ipc_client * client, char * peer, struct ringbuffer * rb, void * head, uint hlen, void * data, uint len){
+	uint ring = 0;
+	while(client->connected){
+		ring = IPC_SPACE(peer)->ring;
+		if(0 == push_ringbuffer(rb, head, hlen, data, len)){
+			return 0;
+		}
+		// The reader may have parked before the records in front
+		ipc_read_post(client);
+		ipc_space_wait(peer, ring);
+	}
+	errno = ENOLIVE;
+	return -1;
+}
+
+// Under EMC_NOWAIT a ring without room for the start of the message fails with EAGAIN
+static int ipc_write_message(struct ipc * ipc_, struct ipc_client * client, int id, ushort cmd, char * data, int length, int flag){
+	struct ipc_data_unit unit = {0};
+	struct ringbuffer * rb = NULL;
+	char * peer = NULL;
+	uint fragment = IPC_FRAGMENT_SIZE(&ipc_->geometry), size = 0;
+
+	if(!client->buffer || (EMC_REMOTE == ipc_->type && !ipc_->buffer)){
+		errno = ENOLIVE;
+		return -1;
+	}
+	if(EMC_REMOTE == ipc_->type && EMC_CMD_DATA == cmd){
+		// Data of a client goes through its own ring,login and logout through the ring of the server
+		peer = ipc_->buffer;
+		rb = IPC_OUT_RING(peer, &ipc_->geometry);
+	}else{
+		peer = client->buffer;
+		rb = IPC_RING(peer);
+	}
+	unit.cmd = (uchar)cmd;
+	unit.id = id;
+	unit.serial = global_get_data_serial();
+	unit.total = length;
+	if(EMC_CMD_DATA == cmd && ipc_loaned(ipc_, data)){
+		// Only the offset of a loaned block goes through the ring
+		int64 offset = data - ipc_->buffer;
+		struct ipc_block * block = (struct ipc_block *)(data - IPC_BLOCK_HEAD);
+		unit.cmd = EMC_CMD_LOAN;
+		ipc_number_add(&block->ref, 1);
+		if(EMC_NOWAIT == flag){
+			if(push_ringbuffer(rb, &unit, sizeof(struct ipc_data_unit), &offset, sizeof(int64)) < 0){
+				ipc_number_add(&block->ref, -1);
+				errno = EAGAIN;
+				return -1;
+			}
+		}else if(ipc_push(client, peer, rb, &unit, sizeof(struct ipc_data_unit), &offset, sizeof(int64)) < 0){
+			ipc_number_add(&block->ref, -1);
+			return -1;
+		}
+		ipc_read_post(client);
+		return 0;
+	}
+	if(EMC_CMD_DATA != cmd){
+		if(length > fragment || push_ringbuffer(rb, &unit, sizeof(struct ipc_data_unit), data, length) < 0){
+			return -1;
+		}
+		ipc_read_post(client);
+		return 0;
+	}
+	// Each fragment takes a head and the end of a lap may be left as a pad.
+	// Only a hint,another writer may take the room before the fragments are pushed
+	if(EMC_NOWAIT == flag && length > (int)fragment &&
+		get_ringbuffer_free(rb) < length + (length / fragment + 1) * (sizeof(struct ipc_data_unit) + 16) + fragment){
+		errno = EAGAIN;
+		return -1;
+	}
+	// Messages up to a record go whole,longer ones in fragments.
+	// Under EMC_NOWAIT only the first fragment is refused,the rest of a message begun waits for room,
+	// so no fragments the merger could never complete are left in the ring
+	do{
+		size = length > fragment ? fragment : length;
+		if(EMC_NOWAIT == flag && !unit.no){
+			if(push_ringbuffer(rb, &unit, sizeof(struct ipc_data_unit), data, size) < 0){
+				errno = EAGAIN;
+				return -1;
+			}
+		}else if(ipc_push(client, peer, rb, &unit, sizeof(struct ipc_data_unit), data, size) < 0){
+			return -1;
+		}
+		unit.no ++;
+		data += size;
+		length -= size;
+	}while(length > 0);
+	ipc_read_post(client);
+	return 0;
+}
+
+// The region of the peer stays mapped while the message is written,even if the peer goes meanwhile
+static int write_ipc_data(struct ipc * ipc_, struct ipc_client * client, int id, ushort cmd, char * data, int length, int flag){
+	struct ipc_segment * segment = client->segment;
+	int result = 0, err = 0;
+
+	if(EMC_REMOTE == ipc_->type){
+		// A reconnection waits for the writers counted here before the rings start over
+		ipc_number_add(&client->ref, 1);
+		if(EMC_CMD_DATA == cmd && !client->connected){
+			ipc_number_add(&client->ref, -1);
+			errno = ENOLIVE;
+			return -1;
 		}
 	}
-	return 0;
+	if(segment){
+		ipc_number_add(&segment->ref, 1);
+	}
+	result = ipc_write_message(ipc_, client, id, cmd, data, length, flag);
+	err = errno;
+	ipc_segment_release(segment);
+	if(EMC_REMOTE == ipc_->type){
+		ipc_number_add(&client->ref, -1);
+	}
+	errno = err;
+	return result;
 }
 
-static int write_ipc_data(struct ipc * ipc_, struct ipc_client * client, int id, ushort cmd, char * data, int length){
-	char buffer[MAX_DATA_SIZE] = {0};
+// Append a record to the broadcast area,old records are written over and readers are never waited for
+static void ipc_cast_push(struct ipc_cast * cast, uint64 total, void * head, int hlen, char * data, int len){
+	char * area = IPC_CAST_AREA(cast);
+	uint64 need = (2 * sizeof(uint) + hlen + len + 7) & ~7, pos = cast->head % total;
 
-	if(!client->buffer) return -1;
-	if(MAX_DATA_SIZE >= (length + sizeof(struct ipc_data_unit))){
-		// As long as you can send a packet to complete
-		((struct ipc_data_unit *)buffer)->cmd = cmd;
-		((struct ipc_data_unit *)buffer)->id = id;
-		((struct ipc_data_unit *)buffer)->no = 0;
-		((struct ipc_data_unit *)buffer)->serial = global_get_data_serial();
-		((struct ipc_data_unit *)buffer)->total = length;
-		if(data && length){
-			memcpy(buffer + sizeof(struct ipc_data_unit), data, length);
-		}
-		if(EMC_CMD_DATA != cmd){
-			if(EMC_LOCAL == ipc_->type){
-				if(push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(int64)),
-					buffer, length + sizeof(struct ipc_data_unit)) < 0){
-						return -1;
-				}
-			}else if(EMC_REMOTE == ipc_->type){
-				if(push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(uint) + sizeof(int64) + get_ringarray_size()),
-					buffer, length + sizeof(struct ipc_data_unit)) < 0){
-					return -1;
-				}
-			}
-		}else{
-			while(client->connected){
-				if(EMC_LOCAL == ipc_->type){
-					if(0 == push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(int64)),
-						buffer, length + sizeof(struct ipc_data_unit))){
-							break;
-					}
-				}else if(EMC_REMOTE == ipc_->type){
-					if(0 == push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(uint) + sizeof(int64) + get_ringarray_size()),
-						buffer, length + sizeof(struct ipc_data_unit))){
-						break;
-					}
-				}
-				ipc_read_post(client);
-				micro_wait(1);
-			}
-		}
-		ipc_read_post(client);
-	}else{
-		// Multi-packet transmission
-		uint package = 0,index = 0;
-
-		((struct ipc_data_unit *)buffer)->cmd = EMC_CMD_DATA;
-		((struct ipc_data_unit *)buffer)->id = id;
-		((struct ipc_data_unit *)buffer)->serial = global_get_data_serial();
-		((struct ipc_data_unit *)buffer)->total = length;
-		package = length / IPC_DATA_SIZE;
-		package += (length % IPC_DATA_SIZE)?1:0;
-		for(index = 0; index < package; index ++){
-			((struct ipc_data_unit *)buffer)->no = index;
-			memcpy(buffer + sizeof(struct ipc_data_unit), data, length > IPC_DATA_SIZE?IPC_DATA_SIZE:length);
-			while(client->connected){
-				if(EMC_LOCAL == ipc_->type){
-					if(0==push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(int64)),
-						buffer, length > IPC_DATA_SIZE?IPC_DATA_SIZE:length + sizeof(struct ipc_data_unit))){
-							break;
-					}
-				}else if(EMC_REMOTE == ipc_->type){
-					if(0 == push_ringbuffer((struct ringbuffer *)(client->buffer + sizeof(uint) + sizeof(int64) + get_ringarray_size()),
-						buffer, length > IPC_DATA_SIZE?IPC_DATA_SIZE:length + sizeof(struct ipc_data_unit))){
-						break;
-					}
-				}
-				ipc_read_post(client);
-				micro_wait(1);
-			}
-			length -= length > IPC_DATA_SIZE?IPC_DATA_SIZE:length;
-			data += length > IPC_DATA_SIZE?IPC_DATA_SIZE:length;
-		}
-		ipc_read_post(client);
+	if(total - pos < need){
+		// Skip the end of the lap so that a record is never split
+		cast->reserve = cast->head + total - pos;
+		emc_mb();
+		*(uint *)(area + pos) = (uint)(total - pos);
+		*(uint *)(area + pos + sizeof(uint)) = IPC_CAST_PAD;
+		emc_mb();
+		cast->head = cast->reserve;
+		pos = 0;
 	}
-	return 0;
+	cast->reserve = cast->head + need;
+	emc_mb();
+	*(uint *)(area + pos) = (uint)need;
+	*(uint *)(area + pos + sizeof(uint)) = hlen + len;
+	memcpy(area + pos + 2 * sizeof(uint), head, hlen);
+	memcpy(area + pos + 2 * sizeof(uint) + hlen, data, len);
+	emc_mb();
+	cast->head = cast->reserve;
+}
+
+// Publish once into the broadcast area,in fragments like the rings
+static void ipc_cast_data(struct ipc * ipc_, char * data, int length){
+	struct ipc_data_unit unit = {0};
+	uint fragment = IPC_FRAGMENT_SIZE(&ipc_->geometry), size = 0;
+
+	unit.cmd = EMC_CMD_DATA;
+	unit.id = -1;
+	unit.serial = global_get_data_serial();
+	unit.total = length;
+	do{
+		size = length > fragment ? fragment : length;
+		ipc_cast_push(IPC_CAST(ipc_->buffer, &ipc_->geometry), ipc_->geometry.cast, &unit, sizeof(struct ipc_data_unit), data, size);
+		unit.no ++;
+		data += size;
+		length -= size;
+	}while(length > 0);
 }
 
+// Wake the subscribers after a publish
 static uint ipc_send_pub_foreach_cb(struct map * m, int64 key, void * p, void * addition){
-	if(EMC_SUB == ((struct ipc_client *)p)->mode){
+	struct ipc_client * client = (struct ipc_client *)p;
+	if(EMC_SUB == client->mode && client->connected){
 		struct ipc_data * unit = (struct ipc_data *)addition;
-		struct ipc * ipc_ = unit->ipc_;
-		struct ipc_data * data = NULL;
-
-		data = (struct ipc_data *)malloc(sizeof(struct ipc_data));
-		if(data){
-			data->id = key;
-			data->ipc_ = ipc_;
-			data->flag = unit->flag;
-			data->msg = unit->msg;
-			emc_msg_ref_add(unit->msg);
-			if(push_ringqueue(ipc_->sq, data) < 0){
-				emc_msg_ref_dec(unit->msg);
-				free(data);
-			}
-		}
+		ipc_read_post(client);
+		// If you set the monitor to throw on send success events
+		ipc_post_monitor(unit->ipc_, client, unit->ipc_->port, EMC_EVENT_SNDSUCC, unit->msg);
 	}
 	return 0;
 }
@@ -723,29 +1457,39 @@ static int write_ipc(struct ipc * ipc_, void * msg, int flag){
 	case EMC_SUB:
 		{
 			if(write_ipc_data(ipc_, ipc_->client, ipc_->client->id, EMC_CMD_DATA,
-				(char *)emc_msg_buffer(msg), emc_msg_length(msg)) < 0){
+				(char *)emc_msg_buffer(msg), emc_msg_length(msg), flag) < 0){
+				// A full ring under EMC_NOWAIT is left to the caller
+				if(EAGAIN == errno) return -1;
 				// If you set the monitor to throw on send failure events
-				ipc_post_monitor(ipc_, ipc_->client, (int)ipc_->fd, EMC_EVENT_SNDFAIL, msg);
+				ipc_post_monitor(ipc_, ipc_->client, ipc_->port, EMC_EVENT_SNDFAIL, msg);
 			}else{
 				// If you set the monitor to throw on send succress events
-				ipc_post_monitor(ipc_, ipc_->client, (int)ipc_->fd, EMC_EVENT_SNDSUCC, msg);
+				ipc_post_monitor(ipc_, ipc_->client, ipc_->port, EMC_EVENT_SNDSUCC, msg);
 			}
 		}
 		break;
 	case EMC_REP:
 		{
-			if(map_get(ipc_->server->connection, emc_msg_getid(msg), (void**)&client) < 0){
+			// Held while written,a writer parked on its ring outlives its removal
+			client = ipc_client_get(ipc_, emc_msg_getid(msg));
+			if(!client){
 				errno = ENOEXIST;
 				return -1;
 			}
 			if(write_ipc_data(ipc_, client, emc_msg_getid(msg), EMC_CMD_DATA,
-				(char *)emc_msg_buffer(msg), emc_msg_length(msg)) < 0){
+				(char *)emc_msg_buffer(msg), emc_msg_length(msg), flag) < 0){
+				// A full ring under EMC_NOWAIT is left to the caller
+				if(EAGAIN == errno){
+					ipc_client_drop(ipc_, client);
+					return -1;
+				}
 				// If you set the monitor to throw on send failure events
-				ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_SNDFAIL, msg);
+				ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_SNDFAIL, msg);
 			}else{
 				// If you set the monitor to throw on send success events
-				ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_SNDSUCC, msg);
+				ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_SNDSUCC, msg);
 			}
+			ipc_client_drop(ipc_, client);
 		}
 		break;
 	case EMC_PUB:
@@ -755,6 +1499,7 @@ static int write_ipc(struct ipc * ipc_, void * msg, int flag){
 				nsleep(1);
 			}
 			emc_lock(&ipc_->server->pub_lock);
+			ipc_cast_data(ipc_, (char *)emc_msg_buffer(msg), emc_msg_length(msg));
 			map_foreach(ipc_->server->connection, ipc_send_pub_foreach_cb, &unit);
 			emc_unlock(&ipc_->server->pub_lock);
 		}
@@ -764,7 +1509,7 @@ static int write_ipc(struct ipc * ipc_, void * msg, int flag){
 }
 
 static uint map_foreach_logout_cb(struct map * m, int64 key, void * p, void * addition){
-	write_ipc_data((struct ipc *)addition, (struct ipc_client *)p, (int)key, EMC_CMD_LOGOUT, NULL, 0);
+	write_ipc_data((struct ipc *)addition, (struct ipc_client *)p, (int)key, EMC_CMD_LOGOUT, NULL, 0, 0);
 	return 0;
 }
 
@@ -772,28 +1517,35 @@ static uint map_foreach_check_cb(struct map * m, int64 key, void * p, void * add
 	struct ipc * ipc_ = (struct ipc *)addition;
 	struct ipc_client * client = (struct ipc_client *)p;
 	int64 timeout = 0;
-	
+	int gone = 0;
+#if !defined (EMC_WINDOWS)
+	char name[PATH_LEN] = {0};
+#endif
+
 	if(!client->connected) return 0;
 	timeout = *(int64 *)client->buffer;
 	timeout = time_get_time() - timeout;
-	if(timeout > IPC_TIMEOUT){
-		if(time_get_time()-client->time > IPC_TIMEOUT){
-			// If you set the monitor to throw on disconnect events
-			ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_CLOSED, NULL);
-#if defined (EMC_WINDOWS)
-			CloseHandle(client->evt);
-			client->evt = NULL;
-#else
-			semctl(client->evt, IPC_RMID, NULL);
-			client->evt = -1;
+	// A client whose process exited goes at once,others once their heartbeat stops
+	gone = ipc_peer_gone(client);
+	if(gone || (timeout > IPC_TIMEOUT && time_get_time() - client->time > IPC_TIMEOUT)){
+#if !defined (EMC_WINDOWS)
+		// Its records on the ring of the server reserved and never committed no longer hold the writers behind
+		if(gone && ipc_->buffer){
+			repair_ringbuffer(IPC_RING(ipc_->buffer), (uint)client->pid);
+		}
 #endif
-			if(0 == map_erase(m, key)){
-				push_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), client->locate);
-				global_idle_connect_id(client->id);
-				client->connected = 0;
-				free(client);
-				return 1;
-			}
+		// If you set the monitor to throw on disconnect events
+		ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_CLOSED, NULL);
+#if !defined (EMC_WINDOWS)
+		// The client may have died,its region must not outlive the last mapping
+		ipc_region_name(name, ipc_->port, client->evt_flag);
+		shm_unlink(name);
+#endif
+		// Writers still on its ring keep the region mapped until they let go
+		if(0 == map_erase(m, key)){
+			client->reclaim = 1;
+			ipc_client_retire(ipc_, client);
+			return 1;
 		}
 	}
 	return 0;
@@ -809,28 +1561,50 @@ static uint map_foreach_task_cb(struct map * m, int64 key, void * p, void * addi
 	return 0;
 }
 
+// A writer gone within a record on the ring of the server before its login was taken
+// is not watched,the record is given up once the cursor has waited on it too long
+static void ipc_ring_check(struct ipc * ipc_){
+	struct ringbuffer * rb = IPC_RING(ipc_->buffer);
+	int64 position = -1;
+	uint owner = get_ringbuffer_pending(rb, &position);
+
+	if(!owner || position != ipc_->server->pending){
+		ipc_->server->pending = owner ? position : -1;
+		ipc_->server->pending_time = time_get_time();
+	}else if(time_get_time() - ipc_->server->pending_time > IPC_TIMEOUT && ipc_pid_gone((int)owner)){
+		repair_ringbuffer(rb, owner);
+	}
+}
+
 static void check_ipc(struct ipc * ipc_, int64 * reconnect_time){
 	if(EMC_LOCAL == ipc_->type){
 		if(ipc_->buffer){
-			*(int64 *)(ipc_->buffer + sizeof(uint) + get_ringarray_size()) = time_get_time();
+			*(int64 *)ipc_->buffer = time_get_time();
+			ipc_ring_check(ipc_);
 		}
+		emc_lock(&ipc_->server->conn_lock);
 		map_foreach(ipc_->server->connection, map_foreach_check_cb, ipc_);
+		emc_unlock(&ipc_->server->conn_lock);
 	}else if(EMC_REMOTE == ipc_->type){
 		if(ipc_->buffer){
 			*(int64 *)ipc_->buffer = time_get_time();
 		}
 		if(ipc_->client->connected){
-			int64 timeout = *(int64 *)(ipc_->client->buffer + sizeof(uint) + get_ringarray_size());
+			int64 timeout = *(int64 *)ipc_->client->buffer;
+			int gone = ipc_peer_gone(ipc_->client);
 			timeout = time_get_time() - timeout;
-			if(timeout > IPC_TIMEOUT){
-				if(time_get_time() - ipc_->client->time > IPC_TIMEOUT){
-					if(!ipc_->reconnect){
-						ipc_->reconnect = ipc_->client;
-						if(reopen_ipc(ipc_) < 0){
-							ipc_->reconnect = NULL;
-						}
-						*reconnect_time = time_get_time();
+			// The server process exited,or its heartbeat stopped
+			if(gone || (timeout > IPC_TIMEOUT && time_get_time() - ipc_->client->time > IPC_TIMEOUT)){
+				if(gone){
+					// An exited server gives back none of the blocks it held
+					ipc_loan_reclaim(ipc_, IPC_HELD(ipc_->buffer, IPC_HELD_SERVER), NULL);
+				}
+				if(!ipc_->reconnect){
+					ipc_->reconnect = ipc_->client;
+					if(reopen_ipc(ipc_) < 0){
+						ipc_->reconnect = NULL;
 					}
+					*reconnect_time = time_get_time();
 				}
 			}
 		}else{
@@ -847,6 +1621,9 @@ static void check_ipc(struct ipc * ipc_, int64 * reconnect_time){
 
 static emc_cb_t EMC_CALL  ipc_work_cb(void * args){
 	struct ipc *ipc_ = (struct ipc *)args;
+	if(get_device_affinity(ipc_->device)){
+		set_thread_affinity(get_device_affinity(ipc_->device));
+	}
 	while(!ipc_->exit){
 		read_ipc(ipc_);
 	}
@@ -857,6 +1634,9 @@ static emc_cb_t EMC_CALL ipc_check_cb(void * args){
 	struct ipc *ipc_ = (struct ipc *)args;
 	int64 check_time = time_get_time(); 
 	int64 reconnect_time = time_get_time();
+	if(get_device_affinity(ipc_->device)){
+		set_thread_affinity(get_device_affinity(ipc_->device));
+	}
 	while(!ipc_->exit){
 		check_ipc(ipc_, &reconnect_time);
 		// Receive data every 30 seconds to detect whether the task timeout
@@ -864,7 +1644,7 @@ static emc_cb_t EMC_CALL ipc_check_cb(void * args){
 			map_foreach(ipc_->rmap, map_foreach_task_cb, ipc_);
 			check_time = time_get_time();
 		}
-		nsleep(100);
+		ipc_watch_wait(ipc_, 100);
 	}
 	return (emc_cb_t)0;
 }
@@ -873,24 +1653,32 @@ static emc_cb_t EMC_CALL ipc_send_cb(void * args){
 	struct ipc * ipc_ = (struct ipc *)args;
 	struct ipc_data * data = NULL;
 	struct ipc_client * client = NULL;
+	if(get_device_affinity(ipc_->device)){
+		set_thread_affinity(get_device_affinity(ipc_->device));
+	}
 	while(!ipc_->exit){
 		wait_ringqueue(ipc_->sq);
 		while(0==pop_ringqueue_multiple(ipc_->sq, (void **)&data)){
+			client = NULL;
 			if(EMC_LOCAL == ipc_->type){
-				map_get(ipc_->server->connection, data->id, (void **)&client);
+				client = ipc_client_get(ipc_, data->id);
 			}else if(EMC_REMOTE == ipc_->type){
 				client = ipc_->client;
 			}
 			if(client){
 				if(write_ipc_data(ipc_, client, client->id, EMC_CMD_DATA, (char *)emc_msg_buffer(data->msg),
-					emc_msg_length(data->msg)) < 0){
+					emc_msg_length(data->msg), 0) < 0){
 					// If you set the monitor to throw on send failure events
-					ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_SNDFAIL, data->msg);
+					ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_SNDFAIL, data->msg);
 				}else{
 					// If you set the monitor to throw on send success events
-					ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_SNDSUCC, data->msg);
+					ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_SNDSUCC, data->msg);
+				}
+				if(EMC_LOCAL == ipc_->type){
+					ipc_client_drop(ipc_, client);
 				}
 			}
+			ipc_number_add(&ipc_->queued, -1);
 			emc_msg_ref_dec(data->msg);
 			if(EMC_NOWAIT == data->flag){
 				emc_msg_free(data->msg);
@@ -906,28 +1694,63 @@ static int ipc_reconnect_cb(void * p, void * addition){
 	return reopen_ipc((struct ipc *)addition);
 }
 
+// Sizes of the regions from the plug options,any record must fit a ring and the broadcast area
+static void ipc_geometry_init(struct ipc * ipc_){
+	struct ipc_geometry * g = &ipc_->geometry;
+	int value = 0;
+
+	memset(g, 0, sizeof(struct ipc_geometry));
+	g->magic = IPC_MAGIC;
+	g->version = IPC_VERSION;
+	value = get_plug_option(ipc_->plug, EMC_PLUG_IPC_RING);
+	g->ring = value > 0 ? ((uint)value + 7) & ~7 : IPC_RING_SIZE;
+	if(g->ring < IPC_RING_MIN){
+		g->ring = IPC_RING_MIN;
+	}else if(g->ring > IPC_RING_MAX){
+		g->ring = IPC_RING_MAX;
+	}
+	value = get_plug_option(ipc_->plug, EMC_PLUG_IPC_HEAP);
+	g->heap = value > 0 ? ((uint)value + 15) & ~15 : (value < 0 ? 0 : IPC_LOAN_SIZE);
+	value = get_plug_option(ipc_->plug, EMC_PLUG_IPC_CAST);
+	g->cast = value > 0 ? ((uint)value + 7) & ~7 : IPC_CAST_SIZE;
+	if(g->cast < g->ring){
+		g->cast = g->ring;
+	}
+}
+
 static int init_ipc_server(struct ipc * ipc_){
-	int index = 0;
-#if defined (EMC_WINDOWS)
 	char name[PATH_LEN] = {0};
-	sprintf_s(name, PATH_LEN, "ipc_%ld", ipc_->port);
-	ipc_->fd = CreateFileMapping((HANDLE)-1, NULL, PAGE_READWRITE, 0, IPC_BUFFER_SIZE, name);
+	size_t size = 0;
+#if defined (EMC_WINDOWS)
+	MEMORY_BASIC_INFORMATION mbi;
+	int exist = 0;
+#else
+	struct stat st;
+#endif
+
+	ipc_geometry_init(ipc_);
+	size = IPC_SERVER_SIZE(&ipc_->geometry);
+#if defined (EMC_WINDOWS)
+	ipc_region_name(name, ipc_->port, 0);
+	ipc_->fd = CreateFileMapping((HANDLE)-1, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
 	if(!ipc_->fd){
 		return -1;
 	}else{
+		exist = ERROR_ALREADY_EXISTS == GetLastError();
 		ipc_->buffer = (char *)MapViewOfFile(ipc_->fd, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, 0);
 		if(!ipc_->buffer){
 			return -1;
 		}
-		if(ERROR_ALREADY_EXISTS != GetLastError()){
-			memset(ipc_->buffer, 0, IPC_BUFFER_SIZE);
-			init_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)));
-			for(index = 0; index < IPC_MAX_REMOTE; index ++){
-				push_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), index);
-			}
+		// A mapping still open elsewhere keeps the size it was created with
+		if(!VirtualQuery(ipc_->buffer, &mbi, sizeof(mbi)) || mbi.RegionSize < size){
+			UnmapViewOfFile(ipc_->buffer);
+			ipc_->buffer = NULL;
+			return -1;
+		}
+		if(!exist || memcmp(IPC_GEOMETRY(ipc_->buffer), &ipc_->geometry, sizeof(struct ipc_geometry))){
+			memset(ipc_->buffer, 0, size);
 		}
 	}
-	init_ringbuffer((struct ringbuffer *)(ipc_->buffer + get_ringarray_size() + sizeof(uint) + sizeof(int64)));
 	sprintf_s(name, PATH_LEN, "event_%ld", ipc_->port);
 	ipc_->evt = CreateSemaphore(NULL, 0, 1, name);
 	if(!ipc_->evt){
@@ -935,181 +1758,168 @@ static int init_ipc_server(struct ipc * ipc_){
 		return -1;
 	}
 #else
-	ipc_->fd = shmget(ipc_->port, IPC_BUFFER_SIZE, IPC_CREAT|0666);
+	ipc_region_name(name, ipc_->port, 0);
+	ipc_->fd = shm_open(name, O_RDWR|O_CREAT, 0666);
 	if(ipc_->fd < 0){
 		return -1;
-	}else{
-		struct shmid_ds mds;
-		if(0 == shmctl(ipc_->fd, IPC_STAT, &mds)){
-			if(mds.shm_nattch <= 0){
-				ipc_->buffer = (char *)shmat(ipc_->fd, NULL, 0);
-				if(!ipc_->buffer){
-					return -1;
-				}
-				memset(ipc_->buffer, 0, IPC_BUFFER_SIZE);
-				init_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)));
-				for(index = 0; index < IPC_MAX_REMOTE; index ++){
-					push_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), index);
-				}
-			}else{
-				ipc_->buffer = (char *)shmat(ipc_->fd, NULL, 0);
-				if(!ipc_->buffer){
-					return -1;
-				}
-			}
+	}
+	// A region of another size was left by a server bound with other options,
+	// it is replaced so that the clients still mapping it are not cut short
+	if(fstat(ipc_->fd, &st) < 0 || (st.st_size && (size_t)st.st_size != size)){
+		close(ipc_->fd);
+		shm_unlink(name);
+		ipc_->fd = shm_open(name, O_RDWR|O_CREAT, 0666);
+		if(ipc_->fd < 0){
+			return -1;
 		}
 	}
-	init_ringbuffer((struct ringbuffer *)(ipc_->buffer + get_ringarray_size() + sizeof(uint) + sizeof(int64)));
-	ipc_->evt = semget(ipc_->port + 0xFFFF, 1, IPC_CREAT|0600);
-	if(ipc_->evt<0){
-		shmdt(ipc_->buffer);
-		shmctl(ipc_->fd, IPC_RMID, NULL);
+	if(ftruncate(ipc_->fd, size) < 0){
+		close(ipc_->fd);
+		ipc_->fd = -1;
+		return -1;
+	}
+	ipc_->buffer = ipc_region_map(ipc_->fd, &size);
+	if(!ipc_->buffer){
 		close(ipc_->fd);
 		ipc_->fd = -1;
 		return -1;
 	}
+	// A region left by a server that crashed,or laid out otherwise,starts over
+	if(time_get_time() - *(int64 *)ipc_->buffer >= IPC_TIMEOUT ||
+		memcmp(IPC_GEOMETRY(ipc_->buffer), &ipc_->geometry, sizeof(struct ipc_geometry))){
+		memset(ipc_->buffer, 0, size);
+	}
 #endif
-	ipc_->server->connection = create_map(IPC_MAX_REMOTE);
+	*(int64 *)ipc_->buffer = time_get_time();
+	init_ringbuffer(IPC_RING(ipc_->buffer), ipc_->geometry.ring);
+	ipc_loan_reset(ipc_);
+	// The clients read the geometry before they create their regions
+	emc_mb();
+	*IPC_GEOMETRY(ipc_->buffer) = ipc_->geometry;
+	ipc_->server->connection = create_map(IPC_MAP_SIZE);
 	return 0;
 }
 
-static int init_ipc_client(struct ipc * ipc_){
+// Create the region of the client with the geometry of the server,
+// it is laid out before the threads see it
+static int ipc_client_region(struct ipc * ipc_, struct ipc_geometry * g){
 	uint flag = 0;
-	char buffer[2 * sizeof(uint) + sizeof(ushort)] = {0};
-#if defined (EMC_WINDOWS)
 	char name[PATH_LEN] = {0};
+	char * buffer = NULL;
+	size_t size = IPC_PEER_SIZE(g);
 
-	*(ushort *)buffer = ipc_->client->mode;
+#if defined (EMC_WINDOWS)
 	flag = global_rand_number();
-	sprintf_s(name, PATH_LEN, "event_%ld_%ld", ipc_->port, flag);
+	// The event and the region of the client share a fresh number
 	while(!ipc_->evt){
+		sprintf_s(name, PATH_LEN, "event_%ld_%ld", ipc_->port, flag);
 		ipc_->evt = CreateSemaphore(NULL, 0, 1, name);
-		if(!ipc_->evt){
-			flag = global_rand_number();
-			sprintf_s(name, PATH_LEN, "event_%ld_%ld", ipc_->port, flag);
-		}else{
-			if(ERROR_ALREADY_EXISTS == GetLastError()){
+		if(ipc_->evt && ERROR_ALREADY_EXISTS == GetLastError()){
+			CloseHandle(ipc_->evt);
+			ipc_->evt = NULL;
+		}
+		if(ipc_->evt){
+			ipc_region_name(name, ipc_->port, flag);
+			ipc_->rfd = CreateFileMapping((HANDLE)-1, NULL, PAGE_READWRITE, 0, (DWORD)size, name);
+			if(ipc_->rfd && ERROR_ALREADY_EXISTS == GetLastError()){
+				CloseHandle(ipc_->rfd);
+				ipc_->rfd = NULL;
+			}
+			if(!ipc_->rfd){
 				CloseHandle(ipc_->evt);
 				ipc_->evt = NULL;
-				flag = global_rand_number();
-				sprintf_s(name, PATH_LEN, "event_%ld_%ld", ipc_->port, flag);
 			}
 		}
+		if(!ipc_->evt){
+			flag = global_rand_number();
+		}
 	}
 	ipc_->client->evt_flag = flag;
-	*(uint *)(buffer + sizeof(ushort)) = flag;
-	// Try to open server shared memory 
-	sprintf_s(name, PATH_LEN, "ipc_%ld", ipc_->port);
-	ipc_->fd = OpenFileMapping(FILE_MAP_READ|FILE_MAP_WRITE,TRUE, name);
-	if(ipc_->fd){
-		ipc_->client->buffer = ipc_->buffer = (char *)MapViewOfFile(ipc_->fd, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, 0);
-		if(!ipc_->buffer){
-			CloseHandle(ipc_->fd);
-			ipc_->fd = NULL;
-			return -1;
-		}
-
-		ipc_->client->locate = -1;
-		if(pop_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), (void *)&ipc_->client->locate) < 0){
-			UnmapViewOfFile(ipc_->buffer);
-			CloseHandle(ipc_->fd);
-			ipc_->buffer = NULL;
-			ipc_->fd = NULL;
-			return -1;
-		}
-		if(ipc_->client->locate < 0){
-			UnmapViewOfFile(ipc_->buffer);
-			CloseHandle(ipc_->fd);
-			ipc_->buffer = NULL;
-			ipc_->fd = NULL;
-			return -1;
-		}
-		if(ipc_->buffer){
-			ipc_->buffer = ipc_->buffer + sizeof(uint) + get_ringarray_size() + IPC_PEER_SIZE * (ipc_->client->locate + 1);
-			*(int64 *)ipc_->buffer = time_get_time();
-		}
-		*(int *)(buffer+sizeof(ushort)+sizeof(uint)) = ipc_->client->locate;
-		init_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(int64)));
-		sprintf_s(name, PATH_LEN, "event_%ld", ipc_->port);
-		ipc_->client->evt = OpenSemaphore(SEMAPHORE_ALL_ACCESS, TRUE, name);
-		if(!ipc_->client->evt){
-			UnmapViewOfFile(ipc_->client->buffer);
-			ipc_->buffer = NULL;
-			CloseHandle(ipc_->fd);
-			ipc_->fd = NULL;
-			return -1;
-		}
+	buffer = (char *)MapViewOfFile(ipc_->rfd, FILE_MAP_READ|FILE_MAP_WRITE, 0, 0, 0);
+	if(!buffer){
+		return -1;
 	}
 #else
-	*(ushort *)buffer = ipc_->client->mode;
-	flag = global_rand_number();
-	while(ipc_->evt < 0){
-		ipc_->evt = semget(flag, 1, IPC_CREAT|IPC_EXCL|0600);
-		if(ipc_->evt < 0){
-			flag=global_rand_number();
+	// The region of the client is named by a fresh number
+	while(ipc_->rfd < 0){
+		flag = global_rand_number();
+		if(!flag) continue;
+		ipc_region_name(name, ipc_->port, flag);
+		ipc_->rfd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0666);
+		if(ipc_->rfd < 0 && EEXIST != errno){
+			return -1;
 		}
 	}
 	ipc_->client->evt_flag = flag;
-	*(uint *)(buffer + sizeof(ushort)) = flag;
-	// Try to open server shared memory
-	ipc_->fd = shmget(ipc_->port, 0, IPC_CREAT|0666);
-	if(ipc_->fd >= 0){
-		ipc_->client->buffer = ipc_->buffer = (char *)shmat(ipc_->fd, NULL, 0);
-		if(!ipc_->buffer){
-			shmdt(ipc_->buffer);
-			ipc_->buffer = NULL;
-			close(ipc_->fd);
-			ipc_->fd = -1;
-			semctl(ipc_->evt, IPC_RMID, NULL);
-			return -1;
-		}
-		ipc_->client->locate = -1;
-		if(pop_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), (void *)&ipc_->client->locate) < 0){
-			shmdt(ipc_->buffer);
-			ipc_->buffer = NULL;
-			close(ipc_->fd);
-			semctl(ipc_->evt, IPC_RMID, NULL);
-			ipc_->fd = -1;
-			return -1;
-		}
-		if(ipc_->client->locate < 0){
-			shmdt(ipc_->buffer);
-			ipc_->buffer = NULL;
-			close(ipc_->fd);
-			semctl(ipc_->evt, IPC_RMID, NULL);
-			ipc_->fd = -1;
-			return -1;
-		}
-		if(ipc_->buffer){
-			ipc_->buffer = ipc_->buffer + sizeof(uint) + get_ringarray_size() + IPC_PEER_SIZE * (ipc_->client->locate + 1);
-			*(int64 *)ipc_->buffer = time_get_time();
-		}
-		*(int *)(buffer + sizeof(ushort) + sizeof(uint)) = ipc_->client->locate;
-		init_ringbuffer((struct ringbuffer *)(ipc_->buffer + sizeof(int64)));
-		ipc_->client->evt = semget(ipc_->port + 0xFFFF, 0, IPC_CREAT|0600);
-		if(ipc_->client->evt<0){
-			shmdt(ipc_->client->buffer);
-			ipc_->buffer = NULL;
-			close(ipc_->fd);
-			semctl(ipc_->evt, IPC_RMID, NULL);
-			ipc_->fd = -1;
-			return -1;
-		}
+	if(ftruncate(ipc_->rfd, size) < 0){
+		return -1;
+	}
+	buffer = ipc_region_map(ipc_->rfd, &size);
+	if(!buffer){
+		return -1;
 	}
 #endif
-	// Login packet sent to the server
+	// Messages over blocks of the server list them in the own region,it is unmapped after the last one
+	ipc_->own = (struct ipc_segment *)malloc(sizeof(struct ipc_segment));
+	if(!ipc_->own){
 #if defined (EMC_WINDOWS)
-	if(ipc_->fd && ipc_->client->evt){
+		UnmapViewOfFile(buffer);
 #else
-	if(-1 != ipc_->fd && -1 != ipc_->client->evt){
+		munmap(buffer, size);
 #endif
-		if(ipc_send_register(ipc_, buffer, 2 * sizeof(uint) + sizeof(ushort)) <0){
+		return -1;
+	}
+	memset(ipc_->own, 0, sizeof(struct ipc_segment));
+	ipc_->own->ref = 1;
+	ipc_->own->size = size;
+	ipc_->own->buffer = buffer;
+	ipc_->geometry = *g;
+	*IPC_GEOMETRY(buffer) = *g;
+	init_ringbuffer(IPC_RING(buffer), g->ring);
+	init_ringbuffer(IPC_OUT_RING(buffer, g), g->ring);
+	emc_mb();
+	ipc_->buffer = buffer;
+	return 0;
+}
+
+// Map the server,lay out the own region by its geometry and login.
+// The own region keeps the geometry of the first server,one bound with other sizes is refused
+static int ipc_connect_server(struct ipc * ipc_){
+	struct ipc_geometry geometry;
+
+	if(ipc_attach_server(ipc_) < 0){
+		return -1;
+	}
+	geometry = *IPC_GEOMETRY(ipc_->client->buffer);
+	if(IPC_MAGIC != geometry.magic || IPC_VERSION != geometry.version || geometry.ring < IPC_RING_MIN ||
+		geometry.ring > IPC_RING_MAX || geometry.cast < geometry.ring || ipc_->client->segment->size < IPC_SERVER_SIZE(&geometry)){
+		errno = EINVAL;
+		return -1;
+	}
+	if(!ipc_->buffer){
+		if(ipc_client_region(ipc_, &geometry) < 0){
 			return -1;
 		}
-	}else{
+	}else if(memcmp(&ipc_->geometry, &geometry, sizeof(struct ipc_geometry))){
+		errno = EINVAL;
 		return -1;
 	}
-	return 0;
+	// Writers still on the ring to the last server give up,its loans left unread are given back.
+	// The rings start over,the heap keeps the blocks still out
+	ipc_space_post(ipc_->buffer);
+	while(ipc_->client->ref){
+		nsleep(1);
+	}
+	ipc_loan_reclaim(ipc_, NULL, IPC_OUT_RING(ipc_->buffer, &ipc_->geometry));
+	*(int64 *)ipc_->buffer = time_get_time();
+	init_ringbuffer(IPC_RING(ipc_->buffer), ipc_->geometry.ring);
+	init_ringbuffer(IPC_OUT_RING(ipc_->buffer, &ipc_->geometry), ipc_->geometry.ring);
+	return ipc_send_register(ipc_);
+}
+
+static int init_ipc_client(struct ipc * ipc_){
+	// A server not bound yet is tried again by the check thread
+	return ipc_connect_server(ipc_);
 }
 
 struct ipc * create_ipc(uint ip, ushort port, int device, int plug, unsigned short mode, int type){
@@ -1132,11 +1942,16 @@ struct ipc * create_ipc(uint ip, ushort port, int device, int plug, unsigned sho
 			return NULL;
 		}
 		memset(ipc_->server, 0, sizeof(struct ipc_server));
+		ipc_->server->pending = -1;
 #if !defined (EMC_WINDOWS)
 		ipc_->fd = -1;
-		ipc_->evt = -1;
+		ipc_->rfd = -1;
+		ipc_->watch = epoll_create(IPC_MAP_SIZE);
 #endif
 		if(init_ipc_server(ipc_) < 0){
+#if !defined (EMC_WINDOWS)
+			close(ipc_->watch);
+#endif
 			free(ipc_->server);
 			free(ipc_);
 			return NULL;
@@ -1151,8 +1966,9 @@ struct ipc * create_ipc(uint ip, ushort port, int device, int plug, unsigned sho
 		memset(ipc_->client, 0, sizeof(struct ipc_client));
 #if !defined (EMC_WINDOWS)
 		ipc_->fd = -1;
-		ipc_->evt = -1;
-		ipc_->client->evt = -1;
+		ipc_->rfd = -1;
+		ipc_->watch = epoll_create(IPC_MAP_SIZE);
+		ipc_->client->pidfd = -1;
 #endif
 		ipc_->client->id = -1;
 		ipc_->client->inid = global_get_connect_id();
@@ -1163,7 +1979,7 @@ struct ipc * create_ipc(uint ip, ushort port, int device, int plug, unsigned sho
 		}
 	}
 	ipc_->sq = create_ringqueue(_RQ_M);
-	ipc_->rmap = create_map(IPC_MAX_REMOTE << 3);
+	ipc_->rmap = create_map(IPC_MAP_SIZE << 3);
 	ipc_->twork = emc_thread(ipc_work_cb, ipc_);
 	ipc_->tcheck = emc_thread(ipc_check_cb, ipc_);
 	ipc_->tsend = emc_thread(ipc_send_cb, ipc_);
@@ -1184,12 +2000,15 @@ void delete_ipc(struct ipc * ipc_){
 			delete_map(ipc_->server->connection);
 			free(ipc_->server);
 		}else if(EMC_REMOTE == ipc_->type){
-			write_ipc_data(ipc_, ipc_->client, ipc_->client->id, EMC_CMD_LOGOUT, NULL, 0);
+			write_ipc_data(ipc_, ipc_->client, ipc_->client->id, EMC_CMD_LOGOUT, NULL, 0, 0);
 			term_ipc(ipc_);
 			free(ipc_->client);
 		}
 		delete_ringqueue(ipc_->sq);
 		delete_map(ipc_->rmap);
+		if(ipc_->cast){
+			free(ipc_->cast);
+		}
 		free(ipc_);
 	}
 }
@@ -1197,25 +2016,12 @@ void delete_ipc(struct ipc * ipc_){
 int close_ipc(struct ipc * ipc_, int id){
 	struct ipc_client * client = NULL;
 	if(!ipc_ || EMC_LOCAL != ipc_->type) return -1;
-	if(map_get(ipc_->server->connection, id, (void **)&client) < 0) return -1;
-	write_ipc_data(ipc_, client, id, EMC_CMD_LOGOUT, NULL, 0);
+	client = ipc_client_remove(ipc_, id);
+	if(!client) return -1;
+	write_ipc_data(ipc_, client, id, EMC_CMD_LOGOUT, NULL, 0, 0);
 	// If you set the monitor to throw on disconnect events
-	ipc_post_monitor(ipc_, client, (int)client->evt, EMC_EVENT_CLOSED, NULL);
-	client->connected = 0;
-#if defined (EMC_WINDOWS)
-	if(client->evt){
-		CloseHandle(client->evt);
-		client->evt = NULL;
-	}
-#else
-	close(client->evt);
-	client->evt = -1;
-#endif
-	if(0 == map_erase(ipc_->server->connection, id)){
-		push_ringarray((struct ringarray *)(ipc_->buffer + sizeof(uint)), client->locate);
-		global_idle_connect_id(id);
-		free(client);
-	}
+	ipc_post_monitor(ipc_, client, ipc_->port, EMC_EVENT_CLOSED, NULL);
+	ipc_client_retire(ipc_, client);
 	return 0;
 }
 
@@ -1224,35 +2030,56 @@ int send_ipc(struct ipc * ipc_, void * msg, int flag){
 		errno = EINVAL;
 		return -1;
 	}
-	emc_lock(&ipc_->lock);
 	switch(emc_msg_get_mode(msg)){
 	case EMC_SUB:
 	case EMC_REQ:
 		if(EMC_REMOTE == ipc_->type){
 			if(!ipc_->client->connected) {
 				errno = ENOLIVE;
-				emc_unlock(&ipc_->lock);
 				return -1;
 			}
 			emc_msg_setid(msg, ipc_->client->id);
 		}
 		break;
 	}
-	if(EMC_NOWAIT == flag){
+	// Publishing never waits for subscribers,it is written in place whatever the flag
+	if(EMC_NOWAIT == flag && EMC_PUB != emc_msg_get_mode(msg)){
 		void * msg_r = NULL;
 		struct ipc_data * data = NULL;
-		
+		int result = 0;
+
+		if(!ipc_->queued){
+			// Nothing is queued ahead,the message goes straight into the ring when it has room
+			emc_msg_ref_add(msg);
+			result = write_ipc(ipc_, msg, flag);
+			emc_msg_ref_dec(msg);
+			if(0 == result || EAGAIN != errno){
+				return result;
+			}
+		}
+		// Otherwise the send thread waits for room,up to a bound the caller can see
+		if(ipc_->queued >= IPC_QUEUE_DEPTH){
+			errno = EAGAIN;
+			return -1;
+		}
 		data = (struct ipc_data *)malloc(sizeof(struct ipc_data));
 		if(!data) {
 			errno = ENOMEM;
-			emc_unlock(&ipc_->lock);
 			return -1;
 		}
-		msg_r = emc_msg_alloc(emc_msg_buffer(msg), emc_msg_length(msg));
+		if(ipc_loaned(ipc_, (char *)emc_msg_buffer(msg))){
+			// The queued message shares the loaned block
+			ipc_number_add(&((struct ipc_block *)((char *)emc_msg_buffer(msg) - IPC_BLOCK_HEAD))->ref, 1);
+			msg_r = emc_msg_wrap(emc_msg_buffer(msg), emc_msg_length(msg), ipc_loan_release, NULL);
+			if(!msg_r){
+				ipc_loan_release(emc_msg_buffer(msg), NULL);
+			}
+		}else{
+			msg_r = emc_msg_alloc(emc_msg_buffer(msg), emc_msg_length(msg));
+		}
 		if(!msg_r){
 			free(data);
 			errno = ENOMEM;
-			emc_unlock(&ipc_->lock);
 			return -1;
 		}
 		emc_msg_build(msg_r, msg);
@@ -1261,42 +2088,77 @@ int send_ipc(struct ipc * ipc_, void * msg, int flag){
 		data->flag = flag;
 		data->msg = msg_r;
 		emc_msg_ref_add(msg_r);
-		if(EMC_PUB != emc_msg_get_mode(msg_r)){
-			if(push_ringqueue(ipc_->sq, data) < 0){
-				free(data);
-				emc_msg_free(msg_r);
-				errno = EQUEUE;
-				emc_unlock(&ipc_->lock);
-				return -1;
-			}
-		}else{
-			struct ipc_data unit = {0, flag, ipc_, msg_r};
-			while(ipc_->server->term_lock){
-				nsleep(1);
-			}
-			emc_lock(&ipc_->server->pub_lock);
-			map_foreach(ipc_->server->connection, ipc_send_pub_foreach_cb, &unit);
-			emc_unlock(&ipc_->server->pub_lock);
-		}
-	}else{
-		if(EMC_PUB != emc_msg_get_mode(msg)){
-			emc_msg_ref_add(msg);
+		// Only the bound and the queue are locked,a writer parked on a full ring holds nothing
+		emc_lock(&ipc_->lock);
+		if(ipc_->queued >= IPC_QUEUE_DEPTH){
+			emc_unlock(&ipc_->lock);
+			free(data);
+			emc_msg_free(msg_r);
+			errno = EAGAIN;
+			return -1;
 		}
-		if(write_ipc(ipc_, msg, flag) < 0){
-			if(EMC_PUB != emc_msg_get_mode(msg)){
-				emc_msg_ref_dec(msg);
-			}
+		ipc_number_add(&ipc_->queued, 1);
+		if(push_ringqueue(ipc_->sq, data) < 0){
+			ipc_number_add(&ipc_->queued, -1);
 			emc_unlock(&ipc_->lock);
+			free(data);
+			emc_msg_free(msg_r);
+			errno = EQUEUE;
 			return -1;
 		}
-		if(EMC_PUB == emc_msg_get_mode(msg)){
-			while(0 == emc_msg_zero_ref(msg)){
-				micro_wait(1);
-			}
-		}else{
+		emc_unlock(&ipc_->lock);
+	}else{
+		emc_msg_ref_add(msg);
+		if(write_ipc(ipc_, msg, flag) < 0){
 			emc_msg_ref_dec(msg);
+			return -1;
 		}
+		emc_msg_ref_dec(msg);
+	}
+	return 0;
+}
+
+void * loan_ipc(struct ipc * ipc_, unsigned int size){
+	void * block = NULL, * msg = NULL;
+	if(!ipc_) return NULL;
+	block = ipc_loan_alloc(ipc_, size);
+	if(!block) return NULL;
+	msg = emc_msg_wrap(block, size, ipc_loan_release, NULL);
+	if(!msg){
+		ipc_loan_release(block, NULL);
 	}
-	emc_unlock(&ipc_->lock);
+	return msg;
+}
+
+int pending_ipc(struct ipc * ipc_){
+	if(!ipc_) return 0;
+	return (int)ipc_->queued;
+}
+
+// Whether a live server,possibly in another process,already serves the port
+int check_ipc_server(unsigned short port){
+#if defined (EMC_WINDOWS)
 	return 0;
+#else
+	int fd = -1, alive = 0;
+	char name[PATH_LEN] = {0};
+	char * buffer = NULL;
+	struct stat st;
+
+	ipc_region_name(name, port, 0);
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd < 0){
+		return 0;
+	}
+	if(0 == fstat(fd, &st) && (size_t)st.st_size >= sizeof(int64)){
+		buffer = (char *)mmap(NULL, sizeof(int64), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if(!buffer || MAP_FAILED == buffer){
+		return 0;
+	}
+	alive = time_get_time() - *(int64 *)buffer < IPC_TIMEOUT;
+	munmap(buffer, sizeof(int64));
+	return alive;
+#endif
 }
@@ -35,10 +35,16 @@ extern "C"{
 
 struct ipc;
 
+// ip,the IPv4 address of the server in network order,0 for any address or one of another family
 struct ipc * create_ipc(unsigned int ip, unsigned short port, int device, int plug, unsigned short mode, int type);
 void delete_ipc(struct ipc *);
 int close_ipc(struct ipc *,int);
 int send_ipc(struct ipc *, void * msg, int flag);
+// Message over a block of the shared memory,NULL when the heap is full
+void * loan_ipc(struct ipc *, unsigned int size);
+// Messages sent with EMC_NOWAIT still waiting for room in the ring
+int pending_ipc(struct ipc *);
+int check_ipc_server(unsigned short port);
 
 #ifdef __cplusplus
 }
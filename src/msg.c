@@ -51,6 +51,12 @@ struct message{
 	volatile uint	result;
 	// Additional data, when the monitor is used to return to the upper application
 	void		*	addition;
+	// Buffer owned elsewhere,NULL the data follows the structure
+	void		*	buffer;
+	// Gives the buffer back when the message is freed
+	emc_msg_release_cb * release;
+	// Owner of the buffer,passed to release
+	void		*	owner;
 };
 #pragma pack()
 
@@ -84,6 +90,23 @@ void *emc_msg_alloc(void * data, uint size){
 	return msg_;
 }
 
+void * emc_msg_wrap(void * buffer, uint size, emc_msg_release_cb * release, void * owner){
+	struct message * msg_ = (struct message *)malloc(sizeof(struct message));
+	if(!msg_) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	memset(msg_, 0, sizeof(struct message));
+	msg_->flag = EMC_LIVE;
+	msg_->serial = global_get_data_serial();
+	msg_->id = -1;
+	msg_->len = size;
+	msg_->buffer = buffer;
+	msg_->release = release;
+	msg_->owner = owner;
+	return msg_;
+}
+
 void emc_msg_build(void * msg, const void * old){
 	if(msg && old && msg_check_live(msg) && msg_check_live(old)){
 		((struct message *)msg)->mode = ((struct message *)old)->mode;
@@ -145,12 +168,18 @@ int emc_msg_free (void * msg_){
 	do{}while(0 != msg_number_cas(&((struct message *)msg_)->del, 0, 1));
 	if(!msg_check_live(msg_)) return -1;
 	((struct message *)msg_)->flag = EMC_DEAD;
+	if(((struct message *)msg_)->release){
+		((struct message *)msg_)->release(((struct message *)msg_)->buffer, ((struct message *)msg_)->owner);
+	}
 	free(msg_);
 	return 0;
 }
 
 void *emc_msg_buffer(void * msg_){
 	if(!msg_ || (msg_ && !msg_check_live(msg_))) return NULL;
+	if(((struct message *)msg_)->buffer){
+		return ((struct message *)msg_)->buffer;
+	}
 	return (struct message *)msg_ + 1;
 }
 
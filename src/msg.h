@@ -35,8 +35,13 @@
 extern "C"{
 #endif
 
+// Gives back the buffer of a message that does not own it
+typedef void emc_msg_release_cb(void * buffer, void * owner);
+
 //get message struct size
 int emc_msg_struct_size();
+// Message over a buffer owned elsewhere,release is called when the message is freed
+void * emc_msg_wrap(void * buffer, unsigned int size, emc_msg_release_cb * release, void * owner);
 // Get the message additional data
 void * emc_msg_get_addition(void * msg);
 // Analyzing the message reference count is 0
@@ -37,6 +37,13 @@
 #include "util/ringqueue.h"
 #include "util/utility.h"
 
+// Number of plug option slots
+#define PLUG_OPTIONS	24
+// Endpoint scheme of a unix socket path
+#define PLUG_UNIX_SCHEME	"unix:"
+// Abstract unix socket of a port,used with EMC_PLUG_UNIX
+#define PLUG_UNIX_NAME		"@easymc.%u"
+
 struct easymc_plug{
 	// Device id
 	int					device;
@@ -48,6 +55,8 @@ struct easymc_plug{
 	struct tcp			*tcp_;
 	// Message queue
 	struct ringqueue	*mq;
+	// Plug options,indexed by EMC_PLUG_xxx
+	int					option[PLUG_OPTIONS];
 };
 
 int emc_plug(int device){
@@ -83,7 +92,43 @@ int emc_plug(int device){
 	return id;
 }
 
+int emc_plug_set(int plug, int opt, void * optval, int optlen){
+	int value = 0;
+	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
+	if(!pg){
+		errno = ENOPLUG;
+		return -1;
+	}
+	if(opt <= 0 || opt >= PLUG_OPTIONS || !optval){
+		errno = EINVAL;
+		return -1;
+	}
+	if(sizeof(char) == optlen){
+		value = *(char *)optval;
+	}else if(sizeof(short) == optlen){
+		value = *(short *)optval;
+	}else if(sizeof(int) == optlen){
+		value = *(int *)optval;
+	}else if(sizeof(int64) == optlen){
+		value = (int)*(int64 *)optval;
+	}else{
+		errno = EINVAL;
+		return -1;
+	}
+	pg->option[opt] = value;
+	return 0;
+}
+
+// IPv4 address of the endpoint in network order for the ipc server,
+// 0 when any address is meant or the endpoint is of another family such as IPv6
+static uint plug_ipc_addr(const char * ip){
+	struct in_addr addr = {0};
+	if(!ip || 1 != inet_pton(AF_INET, ip, &addr)) return 0;
+	return (uint)addr.s_addr;
+}
+
 int emc_bind(int plug, const char * ip, const ushort port){
+	char path[PATH_LEN] = {0};
 	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
 	if(!pg){
 		errno = ENOPLUG;
@@ -99,11 +144,25 @@ int emc_bind(int plug, const char * ip, const ushort port){
 	if(!get_device_tcp_mgr(pg->device)){
 		return -1;
 	}
-	pg->tcp_ = add_tcp(ip?inet_addr(ip):0, port, EMC_NONE, EMC_LOCAL, plug, get_device_tcp_mgr(pg->device));
+	// Bound to a unix path only
+	if(ip && 0 == strncmp(ip, PLUG_UNIX_SCHEME, strlen(PLUG_UNIX_SCHEME))){
+		pg->tcp_ = add_tcp(NULL, 0, ip + strlen(PLUG_UNIX_SCHEME), EMC_NONE, EMC_LOCAL, plug, get_device_tcp_mgr(pg->device));
+		return pg->tcp_ ? 0 : -1;
+	}
+	if(get_plug_option(plug, EMC_PLUG_UNIX) > 0){
+		snprintf(path, PATH_LEN, PLUG_UNIX_NAME, port);
+	}
+	pg->tcp_ = add_tcp(ip, port, path[0] ? path : NULL, EMC_NONE, EMC_LOCAL, plug, get_device_tcp_mgr(pg->device));
 	if(!pg->tcp_){
 		return -1;
 	}
-	pg->ipc_ = create_ipc(ip?inet_addr(ip):0, port, pg->device, plug, EMC_NONE, EMC_LOCAL);
+	// Processes sharing the port by SO_REUSEPORT leave the local clients to the first one
+	if(get_plug_option(plug, EMC_PLUG_REUSEPORT) > 0 && check_ipc_server(port)){
+		return 0;
+	}
+	// Local clients reach the server by port,the address is only kept with it.
+	// unix: endpoints never get here
+	pg->ipc_ = create_ipc(plug_ipc_addr(ip), port, pg->device, plug, EMC_NONE, EMC_LOCAL);
 	if(!pg->ipc_){
 		return -1;
 	}
@@ -111,6 +170,7 @@ int emc_bind(int plug, const char * ip, const ushort port){
 }
 
 int emc_connect(int plug, ushort mode, const char * ip, const ushort port){
+	char path[PATH_LEN] = {0};
 	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
 	if(!pg){
 		errno = ENOPLUG;
@@ -129,13 +189,22 @@ int emc_connect(int plug, ushort mode, const char * ip, const ushort port){
 	if(!get_device_tcp_mgr(pg->device)){
 		return -1;
 	}
-	if(!ip || check_local_machine(inet_addr(ip))){
-		pg->ipc_ = create_ipc(inet_addr(ip), port, pg->device, plug, mode, EMC_REMOTE);
+	if(ip && 0 == strncmp(ip, PLUG_UNIX_SCHEME, strlen(PLUG_UNIX_SCHEME))){
+		pg->tcp_ = add_tcp(NULL, port, ip + strlen(PLUG_UNIX_SCHEME), mode, EMC_REMOTE, plug, get_device_tcp_mgr(pg->device));
+		return pg->tcp_ ? 0 : -1;
+	}
+	if(get_plug_option(plug, EMC_PLUG_UNIX) > 0 && (!ip || check_local_machine(ip))){
+		snprintf(path, PATH_LEN, PLUG_UNIX_NAME, port);
+		pg->tcp_ = add_tcp(NULL, port, path, mode, EMC_REMOTE, plug, get_device_tcp_mgr(pg->device));
+		return pg->tcp_ ? 0 : -1;
+	}
+	if(!ip || check_local_machine(ip)){
+		pg->ipc_ = create_ipc(0, port, pg->device, plug, mode, EMC_REMOTE);
 		if(!pg->ipc_){
 			return -1;
 		}
 	}else{
-		pg->tcp_ = add_tcp(inet_addr(ip), port, mode, EMC_REMOTE, plug, get_device_tcp_mgr(pg->device));
+		pg->tcp_ = add_tcp(ip, port, NULL, mode, EMC_REMOTE, plug, get_device_tcp_mgr(pg->device));
 		if(!pg->tcp_){
 			delete_tcp(pg->tcp_);
 			pg->tcp_ = NULL;
@@ -221,6 +290,34 @@ int emc_send(int plug, void * msg, int flag){
 	return result;
 }
 
+void * emc_msg_loan(int plug, uint size){
+	void * msg = NULL;
+	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
+	if(!pg){
+		errno = ENOPLUG;
+		return NULL;
+	}
+	if(pg->ipc_){
+		msg = loan_ipc(pg->ipc_, size);
+	}
+	if(!msg){
+		msg = emc_msg_alloc(NULL, size);
+	}
+	return msg;
+}
+
+int emc_plug_pending(int plug){
+	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
+	if(!pg){
+		errno = ENOPLUG;
+		return -1;
+	}
+	if(pg->ipc_){
+		return pending_ipc(pg->ipc_);
+	}
+	return 0;
+}
+
 int emc_recv(int plug, void ** msg, int flag){
 	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
 	if(!pg){
@@ -264,3 +361,11 @@ ushort get_plug_mode(int plug){
 	}
 	return pg->mode;
 }
+
+int get_plug_option(int plug, int opt){
+	struct easymc_plug * pg = (struct easymc_plug *)global_get_plug(plug);
+	if(!pg || opt <= 0 || opt >= PLUG_OPTIONS){
+		return 0;
+	}
+	return pg->option[opt];
+}
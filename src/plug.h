@@ -35,6 +35,7 @@ extern "C"{
 #endif
 
 	ushort get_plug_mode(int plug);
+	int get_plug_option(int plug, int opt);
 	int push_plug_message(int plug, void * msg);
 
 #ifdef __cplusplus
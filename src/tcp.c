@@ -38,6 +38,8 @@
 #include "util/ringqueue.h"
 #include "util/uniquequeue.h"
 #include "util/lock.h"
+#include "util/queue.h"
+#include "util/compress.h"
 #include "global.h"
 #include "device.h"
 #include "plug.h"
@@ -46,9 +48,57 @@
 #include "tcp.h"
 
 #define TCP_TIMEOUT		100
+// Default length of the listen queue
+#define TCP_BACKLOG		SOMAXCONN
+// Interval of the load sampling in milliseconds
+#define TCP_SAMPLE_TIME		1000
+// Cost of a message in bytes when computing the load and the quantum
+#define TCP_MSG_COST		256
+// Default bytes a connection may read or write per turn
+#define TCP_QUANTUM			65536
+
+// Connection states,only ever move forward until the connection is closed
+#define TCP_STATE_CLOSED		0	// No socket
+#define TCP_STATE_CONNECTING	1	// Connection attempt waiting on the reactor,client side only
+#define TCP_STATE_OPEN			2	// Socket up,the client has queued its login ahead of any data
+#define TCP_STATE_READY			3	// Login seen,the server knows the mode and the client the agreed features
+// Areas below this load are never rebalanced
+#define TCP_BALANCE_LOAD	0x100000
+// Time allowed for a connection attempt in milliseconds
+#define TCP_CONNECT_TIMEOUT	3000
+// Bounds of the reconnection backoff in milliseconds
+#define TCP_BACKOFF_MIN		100
+#define TCP_BACKOFF_MAX		10000
+// Frame length flag of a compressed payload
+#define TCP_COMPRESSED		0x8000
+// Default smallest payload worth compressing
+#define TCP_COMPRESS_MIN	256
+// Payloads that did not shrink in a row before the codec is bypassed,
+// and the number of frames it is bypassed for
+#define TCP_COMPRESS_MISSES	8
+#define TCP_COMPRESS_SKIP	64
+// Features offered in the login packet
+#define TCP_FEATURE_COMPACT	0x01	// Single frame data may use the compact header
+// Longest head of a compact frame,the logo and the varint
+#define TCP_COMPACT_HEAD	4
+
+#if !defined (EMC_WINDOWS) && defined (SO_ZEROCOPY) && defined (MSG_ZEROCOPY)
+#define TCP_ZEROCOPY
+// Frame header length
+#define TCP_HEAD_SIZE		(sizeof(uint) + sizeof(struct tcp_data_unit))
+// Io vectors per sendmsg
+#define TCP_IOV_SIZE		64
+#endif
+
+#if !defined (EMC_WINDOWS)
+// Unix domain sockets for the peers on the same host
+#define TCP_UNIX
+#endif
 
 #if !defined (EMC_WINDOWS)
 #define TCP_FD_SIZE		64
+// Connections accepted per listener wakeup
+#define TCP_ACCEPT_BATCH	64
 #endif
 
 #if defined (EMC_WINDOWS)
@@ -83,6 +133,14 @@ struct tcp_data{
 	// Do not send out the remaining length
 	volatile uint			lave;
 	void					*msg;
+	// Frame headers of a zero copy message
+	char					*hdr;
+	// Bytes of a zero copy message on the wire
+	uint					sent;
+	// Completion key of the last zero copy send
+	uint					zckey;
+	// Link in the zero copy completion list
+	struct emc_queue		link;
 };
 
 struct tcp_unit{
@@ -95,12 +153,28 @@ struct tcp_unit{
 struct tcp_area{
 	// Number of socket has been connected
 	volatile uint			count;
+	// Bytes per second of all the connections
+	volatile uint64			load;
+	// Last time the load was sampled
+	int64					sample;
+	// Connections served by the area
+	struct emc_queue		clients;
+	// Cpu the area threads run on,0 not bound
+	uint64					cpu;
+	// The work thread has set the area up
+	volatile uint			ready;
+	// Busy poll budget in microseconds,0 sleep when idle
+	volatile uint			budget;
+	// Event batches handled by the work thread,a closed socket is freed once it moves on
+	volatile uint64			passes;
 	// Id send queue
 	struct uniquequeue		*wmq;
 #if defined (EMC_WINDOWS)
 	HANDLE					fd;
 #else
 	int						fd;
+	// Descriptor given up to refuse a connection when the process runs out of them
+	int						reserve;
 #endif
 	// Thread
 	emc_result_t			twork;
@@ -110,12 +184,18 @@ struct tcp_area{
 };
 
 struct tcp_server{
-	//socket handle
-	int						fd;
+	// Listening sockets,one per area when sharded by SO_REUSEPORT,then the unix one.
+	// Each is allocated alone,in an array of the packed clients a lock may straddle two cache lines
+	struct tcp_client		**listener;
+	uint					listeners;
+	// Number of the tcp listeners sharing the port
+	uint					shards;
 	// Whether in publishing
 	volatile uint			pub;
+#if defined (EMC_WINDOWS)
 	// accept thread
-	emc_result_t			taccept;			
+	emc_result_t			taccept;
+#endif
 	struct tcp				*tcp_;
 	struct hashmap			*connection;
 };
@@ -128,9 +208,12 @@ struct tcp_client{
 	ushort					mode;
 	char					ip[ADDR_LEN];
 	ushort					port;
-	uint					connected;
-	// Connection process is completed
-	volatile uint			completed;
+	// TCP_STATE_*,data may be sent from TCP_STATE_OPEN on
+	volatile uint			state;
+	// Listening socket of a bound plug
+	uint					listener;
+	// Held by the thread currently writing the socket
+	volatile uint			sending;
 #if defined (EMC_WINDOWS)
 	struct tcp_ol			olr;
 #endif
@@ -138,6 +221,53 @@ struct tcp_client{
 	struct tcp_area			*area;
 	// Reading data unpack
 	void					*rupk;
+	// The rest of a frame the socket did not accept
+	char					*wbuf;
+	int						wlen;
+	int						wpos;
+	// Traffic since the last sample
+	volatile uint			rbytes;
+	volatile uint			wbytes;
+	volatile uint			rmsgs;
+	volatile uint			wmsgs;
+	// Bytes per second,smoothed
+	uint64					load;
+	// Link in the area connections
+	struct emc_queue		link;
+	// Zero copy sends are enabled on the socket
+	uint					zcopy;
+	// Next zero copy completion key
+	uint					zckey;
+	// Zero copy data waiting for the completion
+	struct emc_queue		zcq;
+	// Time the connection attempt is given up
+	int64					deadline;
+	// Time of the next connection attempt
+	int64					retry;
+	// Current reconnection backoff in milliseconds
+	uint					backoff;
+	// The socket is corked,flushed whenever the send queue runs empty
+	uint					cork;
+	// Address family of the socket
+	int						family;
+	// Credentials of the peer process on a unix socket
+	int						pid;
+	int						uid;
+	int						gid;
+	// Codec agreed at login,0 not compressed
+	uint					codec;
+	// Smallest payload to compress
+	uint					zmin;
+	// Incompressible payloads in a row,frames left to bypass the codec
+	uint					zmiss;
+	uint					zskip;
+	// Peer accepts compact frames
+	uint					compact;
+	// Deficit round robin between the connections of an area,
+	// bytes granted per turn and the credit left in each direction
+	int						quantum;
+	int						rdeficit;
+	int						wdeficit;
 };
 
 struct tcp{
@@ -149,10 +279,13 @@ struct tcp{
 	struct tcp_mgr			*mgr;
 	// tcp type: local / remote
 	int						type;
-	//ip
-	int						ip;
+	// Address to bind or connect,ipv4 or ipv6
+	struct sockaddr_storage	addr;
+	socklen_t				addrlen;
 	//port
 	ushort					port;
+	// Unix socket path,a leading '@' names an abstract socket
+	char					path[PATH_LEN];
 	// Message received task list
 	struct map				*rmap;
 	struct tcp_server		*server;
@@ -165,6 +298,10 @@ struct tcp_mgr{
 	// Device ID
 	int						device;
 	struct tcp_area			*area;
+	// Number of areas
+	uint					count;
+	// Area connections list lock
+	volatile uint			lst_lck;
 	//close lock
 	volatile uint			term_lck;
 	// exit
@@ -186,16 +323,8 @@ static uint tcp_number_cas(volatile uint * key, uint _old, uint _new){
 #endif
 }
 
-static void tcp_number_add(volatile uint * n){
-	do{}while(0 != tcp_number_cas(n, 0, 1));
-}
-
-static void tcp_number_dec(volatile uint * n){
-	do{}while(1 != tcp_number_cas(n, 1, 0));
-}
-
 // Set the socket keepalive properties
-static int tcp_set_keepalive(int fd){
+static int tcp_set_keepalive(int fd, int plug){
 	int keepalive = 1;
 #if defined (EMC_WINDOWS)
 #define SIO_KEEPALIVE_VALS _WSAIOW(IOC_VENDOR, 4) 
@@ -209,10 +338,25 @@ static int tcp_set_keepalive(int fd){
 	setting.onoff = 1 ;
 	setting.keepalivetime = 10000 ; // Keep Alive
 	setting.keepaliveinterval = 3000 ; // Resend if No-Reply
+	if(get_plug_option(plug, EMC_PLUG_KEEPIDLE) > 0){
+		setting.keepalivetime = get_plug_option(plug, EMC_PLUG_KEEPIDLE) * 1000;
+	}
+	if(get_plug_option(plug, EMC_PLUG_KEEPINTVL) > 0){
+		setting.keepaliveinterval = get_plug_option(plug, EMC_PLUG_KEEPINTVL) * 1000;
+	}
 #else
 	int keepidle = 10; // If the connection within 10 seconds without any data exchanges, then probed
 	int keepinterval = 3; // When contracting probe interval is 3 seconds
 	int keepcount = 5; // Attempts to detect if the 1st probe packets received a response, and then five times longer hair.
+	if(get_plug_option(plug, EMC_PLUG_KEEPIDLE) > 0){
+		keepidle = get_plug_option(plug, EMC_PLUG_KEEPIDLE);
+	}
+	if(get_plug_option(plug, EMC_PLUG_KEEPINTVL) > 0){
+		keepinterval = get_plug_option(plug, EMC_PLUG_KEEPINTVL);
+	}
+	if(get_plug_option(plug, EMC_PLUG_KEEPCNT) > 0){
+		keepcount = get_plug_option(plug, EMC_PLUG_KEEPCNT);
+	}
 #endif
 	if(setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (char*)&keepalive, sizeof(keepalive)) < 0) return -1;
 #if defined (EMC_WINDOWS)
@@ -225,19 +369,195 @@ static int tcp_set_keepalive(int fd){
 	return 0;
 }
 
-// Gets the minimum number of threads connected
+// Parse a numeric ipv4 or ipv6 address,without one the plug binds both stacks
+static int tcp_resolve(struct tcp * tcp_, const char * ip){
+	struct addrinfo hints, * res = NULL;
+	struct sockaddr_in6 * sa6 = (struct sockaddr_in6 *)&tcp_->addr;
+	int fd = -1;
+
+	memset(&tcp_->addr, 0, sizeof(struct sockaddr_storage));
+	if(!ip){
+		// An ipv6 socket bound to any address also takes the ipv4 connections
+		fd = socket(AF_INET6, SOCK_STREAM, 0);
+		if(fd >= 0){
+			_close_socket(fd);
+			sa6->sin6_family = AF_INET6;
+			sa6->sin6_addr = in6addr_any;
+			sa6->sin6_port = htons(tcp_->port);
+			tcp_->addrlen = sizeof(struct sockaddr_in6);
+		}else{
+			((struct sockaddr_in *)&tcp_->addr)->sin_family = AF_INET;
+			((struct sockaddr_in *)&tcp_->addr)->sin_addr.s_addr = INADDR_ANY;
+			((struct sockaddr_in *)&tcp_->addr)->sin_port = htons(tcp_->port);
+			tcp_->addrlen = sizeof(struct sockaddr_in);
+		}
+		return 0;
+	}
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	// Numeric only,a name lookup would block the caller
+	hints.ai_flags = AI_NUMERICHOST;
+	if(0 != getaddrinfo(ip, NULL, &hints, &res) || !res){
+		errno = EINVAL;
+		return -1;
+	}
+	memcpy(&tcp_->addr, res->ai_addr, res->ai_addrlen);
+	tcp_->addrlen = (socklen_t)res->ai_addrlen;
+	if(AF_INET6 == tcp_->addr.ss_family){
+		sa6->sin6_port = htons(tcp_->port);
+	}else{
+		((struct sockaddr_in *)&tcp_->addr)->sin_port = htons(tcp_->port);
+	}
+	freeaddrinfo(res);
+	return 0;
+}
+
+// Text form of a socket address,ipv4 mapped ipv6 addresses are shown as ipv4
+static ushort tcp_addr_str(struct sockaddr_storage * ss, char * ip){
+	struct sockaddr_in6 * sa6 = (struct sockaddr_in6 *)ss;
+	struct sockaddr_in * sa = (struct sockaddr_in *)ss;
+
+	if(AF_INET6 == ss->ss_family){
+		if(IN6_IS_ADDR_V4MAPPED(&sa6->sin6_addr)){
+			inet_ntop(AF_INET, (char *)&sa6->sin6_addr + 12, ip, ADDR_LEN);
+		}else{
+			inet_ntop(AF_INET6, &sa6->sin6_addr, ip, ADDR_LEN);
+		}
+		return ntohs(sa6->sin6_port);
+	}
+	inet_ntop(AF_INET, &sa->sin_addr, ip, ADDR_LEN);
+	return ntohs(sa->sin_port);
+}
+
+// Apply the socket tuning options of the plug,unix sockets only take the buffer sizes
+static int tcp_set_options(struct tcp * tcp_, int fd, int family){
+	int value = 0;
+
+	// Without a size the system keeps tuning the buffers to the link
+	value = get_plug_option(tcp_->plug, EMC_PLUG_SNDBUF);
+	if(value > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&value, sizeof(int)) < 0) return -1;
+	value = get_plug_option(tcp_->plug, EMC_PLUG_RCVBUF);
+	if(value > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&value, sizeof(int)) < 0) return -1;
+	if(AF_UNIX == family) return 0;
+	if(tcp_set_keepalive(fd, tcp_->plug) < 0) return -1;
+	value = 1;
+	if(get_plug_option(tcp_->plug, EMC_PLUG_NODELAY) > 0 &&
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&value, sizeof(int)) < 0) return -1;
+#if defined (TCP_CORK)
+	if(get_plug_option(tcp_->plug, EMC_PLUG_CORK) > 0 &&
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, (char *)&value, sizeof(int)) < 0) return -1;
+#endif
+#if defined (TCP_NOTSENT_LOWAT)
+	value = get_plug_option(tcp_->plug, EMC_PLUG_NOTSENT_LOWAT);
+	if(value > 0 && setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, (char *)&value, sizeof(int)) < 0) return -1;
+#endif
+	return 0;
+}
+
+#if defined (TCP_UNIX)
+// Build the address of a unix socket path
+static socklen_t tcp_unix_addr(const char * path, struct sockaddr_un * addr){
+	size_t len = strlen(path);
+
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if(len >= sizeof(addr->sun_path)){
+		len = sizeof(addr->sun_path) - 1;
+	}
+	memcpy(addr->sun_path, path, len);
+	// Abstract names live outside the file system and vanish with the socket
+	if('@' == path[0]){
+		addr->sun_path[0] = 0;
+	}
+	return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+}
+
+// Identify the process on the other end of a unix socket
+static void tcp_peer_cred(struct tcp_client * client){
+	struct ucred cred;
+	socklen_t len = sizeof(struct ucred);
+
+	if(0 == getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, (char *)&cred, &len)){
+		client->pid = cred.pid;
+		client->uid = cred.uid;
+		client->gid = cred.gid;
+	}
+}
+#endif
+
+#if defined (TCP_CORK)
+// Push out the partial segment a corked socket holds back
+static void tcp_uncork(struct tcp_client * client){
+	int value = 0;
+	if(client->cork){
+		setsockopt(client->fd, IPPROTO_TCP, TCP_CORK, (char *)&value, sizeof(int));
+		value = 1;
+		setsockopt(client->fd, IPPROTO_TCP, TCP_CORK, (char *)&value, sizeof(int));
+	}
+}
+#endif
+
+#if !defined (EMC_WINDOWS)
+// Let the socket poll the device queue instead of waiting for the interrupt
+static void tcp_set_busypoll(int fd, int budget){
+	int prefer = 1;
+#if defined (SO_BUSY_POLL)
+	setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, (char *)&budget, sizeof(int));
+#endif
+#if defined (SO_PREFER_BUSY_POLL)
+	setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, (char *)&prefer, sizeof(int));
+#endif
+}
+#endif
+
+// Gets the least loaded thread,a connection weighs as much as the average one
 static struct tcp_area* tcp_least_thread(struct tcp_mgr * mgr){
-	uint index = 0, count = EMC_SOCKETS_DEFAULT, result = 0;
-	for(index = 0; index < get_device_thread(mgr->device); index ++){
-		if(mgr->area[index].count < count){
-			count = mgr->area[index].count;
+	uint index = 0, count = 0, result = 0;
+	uint64 load = 0, weight = 1, score = 0, least = 0;
+	for(index = 0; index < mgr->count; index ++){
+		load += mgr->area[index].load;
+		count += mgr->area[index].count;
+	}
+	if(count && load / count > weight){
+		weight = load / count;
+	}
+	for(index = 0; index < mgr->count; index ++){
+		score = mgr->area[index].load + mgr->area[index].count * weight;
+		if(!index || score < least){
+			least = score;
 			result = index;
-			if(!count) break;
 		}
 	}
 	return mgr->area + result;
 }
 
+// Add the connection to the area it is served by
+static void tcp_area_attach(struct tcp_area * area, struct tcp_client * client){
+	emc_lock(&area->mgr->lst_lck);
+	client->area = area;
+	emc_queue_insert_tail(&area->clients, &client->link);
+	area->count ++;
+	emc_unlock(&area->mgr->lst_lck);
+}
+
+// Remove the connection from its area,after that the area no longer changes
+static void tcp_area_detach(struct tcp_client * client){
+	emc_lock(&client->area->mgr->lst_lck);
+	if(client->link.next){
+		emc_queue_remove(&client->link);
+		client->link.prev = client->link.next = NULL;
+		client->area->count --;
+		if(client->area->load > client->load){
+			client->area->load -= client->load;
+		}else{
+			client->area->load = 0;
+		}
+		client->load = 0;
+	}
+	emc_unlock(&client->area->mgr->lst_lck);
+}
+
 static int tcp_add_event(struct tcp_area * area, struct tcp_client * client, uint mask){
 #if defined (EMC_WINDOWS)
 	unsigned long flag = 0, length = 0;
@@ -256,8 +576,12 @@ static int tcp_add_event(struct tcp_area * area, struct tcp_client * client, uin
 	}
 #else
 	struct epoll_event e;
+	e.events = 0;
 	if(mask & EMC_READ){
-		e.events = EPOLLIN;
+		e.events |= EPOLLIN;
+	}
+	if(mask & EMC_WRITE){
+		e.events |= EPOLLOUT;
 	}
 	e.data.u64 = 0; /* avoid valgrind warning */
 	e.data.ptr = client;
@@ -284,6 +608,23 @@ static int tcp_set_event(struct tcp_area * area, struct tcp_client * client, uin
 	}
 	return 0;
 }
+#else
+static int tcp_set_event(struct tcp_area * area, struct tcp_client * client, uint mask){
+	struct epoll_event e;
+	e.events = 0;
+	if(mask & EMC_READ){
+		e.events |= EPOLLIN;
+	}
+	if(mask & EMC_WRITE){
+		e.events |= EPOLLOUT;
+	}
+	e.data.u64 = 0;
+	e.data.ptr = client;
+	if(epoll_ctl(area->fd, EPOLL_CTL_MOD, client->fd, &e) < 0){
+		return -1;
+	}
+	return 0;
+}
 #endif
 
 #if !defined (EMC_WINDOWS)
@@ -303,10 +644,22 @@ static void tcp_release_msg(struct tcp_data * data){
 			emc_msg_free(data->msg);
 		}
 		data->msg = NULL;
+		if(data->hdr){
+			free(data->hdr);
+		}
 		free(data);
 	}
 }
 
+// Free the data that never made it to the send queue
+static void tcp_free_data(struct tcp_data * data){
+	data->flag = EMC_DEAD;
+	if(data->hdr){
+		free(data->hdr);
+	}
+	free(data);
+}
+
 // Throws monitoring messages
 static void tcp_post_monitor(struct tcp * tcp_, struct tcp_client * client, int evt, void * msg){
 	// If you set the monitor option throws up message
@@ -319,6 +672,9 @@ static void tcp_post_monitor(struct tcp * tcp_, struct tcp_client * client, int
 				md->id = client->id;
 				strncpy(md->ip, client->ip, ADDR_LEN);
 				md->port = client->port;
+				md->pid = client->pid;
+				md->uid = client->uid;
+				md->gid = client->gid;
 			}
 			if(msg){
 				md->addition = emc_msg_get_addition(msg);
@@ -328,40 +684,43 @@ static void tcp_post_monitor(struct tcp * tcp_, struct tcp_client * client, int
 	}
 }
 
-// The server sends the login back packet
-static void tcp_send_loginback(struct tcp * tcp_, int id, struct tcp_client * client){
-	void * msg = emc_msg_alloc(NULL, sizeof(ushort));
+// The server sends the login back packet,with the codec and the features it agreed to.
+// They are given apart,the client takes them only once the packet is queued
+static void tcp_send_loginback(struct tcp * tcp_, int id, struct tcp_client * client, ushort mode, uint codec, uint compact){
+	void * msg = emc_msg_alloc(NULL, sizeof(ushort) + 2 * sizeof(uchar));
 	emc_msg_setid(msg, id);
-	*(ushort *)emc_msg_buffer(msg) = client->mode;
+	*(ushort *)emc_msg_buffer(msg) = mode;
+	*((uchar *)emc_msg_buffer(msg) + sizeof(ushort)) = (uchar)codec;
+	*((uchar *)emc_msg_buffer(msg) + sizeof(ushort) + sizeof(uchar)) = compact ? TCP_FEATURE_COMPACT : 0;
 	if(tcp_send_data(tcp_, client, EMC_CMD_LOGIN, EMC_NOWAIT, msg) < 0){
 		emc_msg_free(msg);
 	}
 }
 
+// Hand a received message to the plug
+static void tcp_push_data(struct tcp * tcp_, struct tcp_client * client, int id, char * data, int len){
+	struct message * msg = (struct message *)emc_msg_alloc(data, len);
+	if(msg){
+		emc_msg_setid(msg, id);
+		emc_msg_set_mode(msg, client->mode);
+		if(push_plug_message(tcp_->plug, msg) < 0){
+			emc_msg_free(msg);
+		}
+	}
+}
+
 // tcp  data consolidation callback function
 static void tcp_merger_cb(char * data, int len, int id, void * addition){
 	struct tcp * tcp_ = (struct tcp *)addition;
 	struct tcp_client * client = NULL;
-	struct message * msg = (struct message *)emc_msg_alloc(data, len);
 
 	if(EMC_LOCAL == tcp_->type){
 		client = (struct tcp_client *)hashmap_search(tcp_->server->connection, id);
 	}else if(EMC_REMOTE == tcp_->type){
 		client = tcp_->client;
 	}
-	if(client && msg){
-		emc_msg_setid(msg, id);
-		emc_msg_set_mode(msg, client->mode);
-		if(!client->completed){
-			nsleep(1);
-			if(!client->completed){
-				emc_msg_free(msg);
-				msg = NULL;
-			}
-		}
-		if(msg && push_plug_message(tcp_->plug, msg) < 0){
-			emc_msg_free(msg);
-		}
+	if(client){
+		tcp_push_data(tcp_, client, id, data, len);
 	}
 }
 
@@ -369,6 +728,9 @@ static void tcp_merger_cb(char * data, int len, int id, void * addition){
 static void tcp_unpack_cb(char * data, unsigned short len, int id, void * args){
 	struct tcp_client * client = NULL;
 	struct tcp * tcp_ = (struct tcp *)args;
+	char plain[MAX_PROTOCOL_SIZE];
+	int length = 0, head = sizeof(struct tcp_data_unit);
+	uint codec = 0, features = 0;
 	
 	if(EMC_LOCAL == tcp_->type){
 		client = (struct tcp_client *)hashmap_search(tcp_->server->connection, id);
@@ -376,32 +738,55 @@ static void tcp_unpack_cb(char * data, unsigned short len, int id, void * args){
 		client = tcp_->client;
 	}
 	if(client){
-		if(((struct tcp_data_unit *)data)->total <= TCP_DATA_SIZE){
+		client->rmsgs ++;
+		if(len & UNPACK_COMPACT){
+			// Single frame data without the unit header
+			len &= ~UNPACK_COMPACT;
+			head = 0;
+		}
+		if(len & UNPACK_COMPRESSED){
+			len &= ~UNPACK_COMPRESSED;
+			if(!client->codec || len < head) return;
+			length = decompress_data(client->codec, data + head, len - head, plain + head, TCP_DATA_SIZE);
+			if(length <= 0) return;
+			memcpy(plain, data, head);
+			data = plain;
+			len = (unsigned short)(length + head);
+		}
+		if(!head){
+			tcp_push_data(tcp_, client, id, data, len);
+		}else if(((struct tcp_data_unit *)data)->total <= TCP_DATA_SIZE){
 			if(EMC_CMD_LOGIN == ((struct tcp_data_unit *)data)->cmd){
+				// Older peers send the mode only
+				if(len >= sizeof(struct tcp_data_unit) + sizeof(ushort) + sizeof(uchar)){
+					codec = *(uchar *)(data + sizeof(struct tcp_data_unit) + sizeof(ushort));
+				}
+				if(len >= sizeof(struct tcp_data_unit) + sizeof(ushort) + 2 * sizeof(uchar)){
+					features = *(uchar *)(data + sizeof(struct tcp_data_unit) + sizeof(ushort) + sizeof(uchar));
+				}
 				if(EMC_LOCAL == tcp_->type){
+					if(get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS) <= 0 || !compress_has(codec)){
+						codec = 0;
+					}
+					features &= TCP_FEATURE_COMPACT;
+					// Frames are cut with the codec and the format of the moment they are written,
+					// so whatever a publisher queues from now on must follow the login back
+					tcp_send_loginback(tcp_, id, client, *(ushort *)(data + sizeof(struct tcp_data_unit)), codec, features);
+					client->codec = codec;
+					client->compact = features;
+					emc_mb();
 					client->mode = *(ushort *)(data + sizeof(struct tcp_data_unit));
-					tcp_send_loginback(tcp_, id, client);
+					client->state = TCP_STATE_READY;
 				}else if(EMC_REMOTE == tcp_->type){
-					tcp_number_add(&client->completed);
-					tcp_post_monitor(tcp_, client, EMC_EVENT_CONNECT, NULL);
-				}
-			}else if(EMC_CMD_DATA == ((struct tcp_data_unit *)data)->cmd){
-				struct message * msg = (struct message *)emc_msg_alloc(data + sizeof(struct tcp_data_unit),
-					len - sizeof(struct tcp_data_unit));
-				if(msg){
-					emc_msg_setid(msg, id);
-					emc_msg_set_mode(msg, client->mode);
-					if(!client->completed){
-						nsleep(1);
-						if(!client->completed){
-							emc_msg_free(msg);
-							msg = NULL;
-						}
-					}
-					if(msg && push_plug_message(tcp_->plug, msg) < 0){
-						emc_msg_free(msg);
+					if(codec && (int)codec == get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS)){
+						client->codec = codec;
 					}
+					client->compact = features & TCP_FEATURE_COMPACT;
+					client->backoff = 0;
+					client->state = TCP_STATE_READY;
 				}
+			}else if(EMC_CMD_DATA == ((struct tcp_data_unit *)data)->cmd){
+				tcp_push_data(tcp_, client, id, data + sizeof(struct tcp_data_unit), len - sizeof(struct tcp_data_unit));
 			}			
 		} else {
 			void * mg = NULL;
@@ -458,13 +843,72 @@ static int tcp_recv_data(int fd, char * buf, int len){
 	return nread;
 }
 
-//	Callback client reconnection
+// Schedule the next connection attempt,exponential backoff with jitter
+static void tcp_backoff(struct tcp_client * client){
+	if(client->backoff < TCP_BACKOFF_MIN){
+		client->backoff = TCP_BACKOFF_MIN;
+	}else if(client->backoff < TCP_BACKOFF_MAX / 2){
+		client->backoff *= 2;
+	}else{
+		client->backoff = TCP_BACKOFF_MAX;
+	}
+	client->retry = time_get_time() + client->backoff / 2 + rand() % (client->backoff / 2 + 1);
+}
+
+// The client connection is up,serve it on its area and log in
+static void tcp_connect_done(struct tcp * tcp_){
+#if defined (TCP_UNIX)
+	if(AF_UNIX == tcp_->client->family){
+		tcp_peer_cred(tcp_->client);
+	}
+#endif
+	tcp_area_attach(tcp_->client->area, tcp_->client);
+	// Queued before the connection opens,so it is the first frame on the wire
+	// and the data sent from now on needs no round trip
+	tcp_send_login(tcp_);
+	tcp_->client->state = TCP_STATE_OPEN;
+	tcp_post_monitor(tcp_, tcp_->client, EMC_EVENT_CONNECT, NULL);
+}
+
+#if !defined (EMC_WINDOWS)
+// Give up a connection attempt that did not complete
+static void tcp_abort_connect(struct tcp * tcp_, struct tcp_client * client){
+	emc_lock(&client->sending);
+	if(TCP_STATE_CONNECTING == client->state){
+		client->state = TCP_STATE_CLOSED;
+		tcp_del_event(tcp_, client->area, client->fd);
+		_close_socket(client->fd);
+		client->fd = -1;
+		tcp_backoff(client);
+	}
+	emc_unlock(&client->sending);
+}
+#endif
+
+//	Callback client reconnection,stays registered until the connection is up
 static int tcp_reconnect_cb(void * p, void * addition){
-	if(0 == init_tcp_client((struct tcp *)addition)){
-		tcp_send_login((struct tcp *)addition);
+	struct tcp_client * client = (struct tcp_client *)p;
+	struct tcp * tcp_ = (struct tcp *)addition;
+
+#if !defined (EMC_WINDOWS)
+	if(TCP_STATE_CONNECTING == client->state){
+		if(time_get_time() >= client->deadline){
+			tcp_abort_connect(tcp_, client);
+		}
+		return -1;
+	}
+#endif
+	if(TCP_STATE_OPEN <= client->state){
 		return 0;
 	}
-	return -1;
+	if(time_get_time() < client->retry){
+		return -1;
+	}
+	if(init_tcp_client(tcp_) < 0){
+		tcp_backoff(client);
+		return -1;
+	}
+	return TCP_STATE_OPEN <= client->state ? 0 : -1;
 }
 
 // delete all recv task unit
@@ -480,6 +924,32 @@ static uint tcp_tq_foreach_cb(struct map * m, int64 key, void * p, void * additi
 	return 0;
 }
 
+#if defined (TCP_ZEROCOPY)
+// Release the zero copy data up to the completion key,or all of it as failed.
+// The caller holds client->sending
+static void tcp_zerocopy_done(struct tcp * tcp_, struct tcp_client * client, uint key, int result){
+	struct emc_queue * q = NULL;
+	struct tcp_data * data = NULL;
+
+	while(!emc_queue_empty(&client->zcq)){
+		q = client->zcq.next;
+		data = emc_queue_data(q, struct tcp_data, link);
+		if(result && (int)(data->zckey - key) > 0){
+			break;
+		}
+		emc_queue_remove(q);
+		if(EMC_CMD_DATA == data->cmd){
+			tcp_post_monitor(tcp_, client, result ? EMC_EVENT_SNDSUCC : EMC_EVENT_SNDFAIL, data->msg);
+		}
+		if(result){
+			emc_msg_set_result(data->msg, 1);
+		}
+		emc_msg_ref_dec(data->msg);
+		tcp_release_msg(data);
+	}
+}
+#endif
+
 static int process_close(struct tcp * tcp_, struct tcp_area * area, int id){
 	struct tcp_client * client = NULL;
 	void * msg = NULL;
@@ -499,17 +969,34 @@ static int process_close(struct tcp * tcp_, struct tcp_area * area, int id){
 		}
 	}else if(EMC_REMOTE == tcp_->type){
 		client = tcp_->client;
+		// Closed already,by the reactor or by the plug
+		if(client->fd < 0){
+			emc_unlock(&tcp_->mgr->term_lck);
+			return -1;
+		}
 	}
-	_close_socket(client->fd);
-	client->fd = -1;
-	client->connected = 0;
+	tcp_area_detach(client);
+	area = client->area;
+	// Wait for the thread writing the socket
+	emc_lock(&client->sending);
 #if !defined (EMC_WINDOWS)
 	tcp_del_event(tcp_, area, client->fd);
 #endif
+	_close_socket(client->fd);
+	client->fd = -1;
+	client->state = TCP_STATE_CLOSED;
 	if(client->rupk){
 		global_free_unpack(client->rupk);
 		client->rupk = NULL;
 	}
+	if(client->wbuf){
+		free(client->wbuf);
+		client->wbuf = NULL;
+	}
+	client->wlen = client->wpos = 0;
+#if defined (TCP_ZEROCOPY)
+	tcp_zerocopy_done(tcp_, client, 0, 0);
+#endif
 	while(0==global_pop_sendqueue(id, (void **)&msg)){
 		if(emc_msg_zero_ref(msg) > 0){
 			tcp_post_monitor(tcp_, client, EMC_EVENT_SNDFAIL, msg);
@@ -517,7 +1004,7 @@ static int process_close(struct tcp * tcp_, struct tcp_area * area, int id){
 		}
 	}
 	map_foreach(tcp_->rmap, tcp_tq_foreach_cb, client);
-	area->count --;
+	emc_unlock(&client->sending);
 	if(EMC_LOCAL == tcp_->type){
 		tcp_post_monitor(tcp_, client, EMC_EVENT_CLOSED, NULL);
 		global_idle_connect_id(id);
@@ -526,6 +1013,7 @@ static int process_close(struct tcp * tcp_, struct tcp_area * area, int id){
 	}else if(EMC_REMOTE == tcp_->type){
 		tcp_post_monitor(tcp_, client, EMC_EVENT_CLOSED, NULL);
 		if(!tcp_->exit){
+			tcp_backoff(client);
 			global_add_reconnect(id, tcp_reconnect_cb, client, tcp_);
 		}
 	}
@@ -533,8 +1021,11 @@ static int process_close(struct tcp * tcp_, struct tcp_area * area, int id){
 	return 0;
 }
 
+// Read until the socket is drained or the quantum of the turn is spent,
+// a connection left readable is reported again by the next poll
 static void process_recv(struct tcp * tcp_, struct tcp_area * area, int id){
 	int nread = -1;
+	uint msgs = 0;
 	struct tcp_client * client = NULL;
 	char buffer[MAX_PROTOCOL_SIZE] = {0};
 
@@ -547,13 +1038,23 @@ static void process_recv(struct tcp * tcp_, struct tcp_area * area, int id){
 		}
 	}
 	if(client){
+		client->rdeficit += client->quantum;
 		while(1){
+			if(client->rdeficit <= 0){
+				// Give way to the other connections of the area
+#if defined (EMC_WINDOWS)
+				tcp_set_event(area, client, EMC_READ);
+#endif
+				break;
+			}
 			nread = tcp_recv_data(client->fd, buffer, MAX_PROTOCOL_SIZE);
 			if(nread < 0){
 				//close connection
 				process_close(tcp_, area, id);
 				break;
 			}else if(0 == nread){
+				// Drained,no credit is carried to the next turn
+				client->rdeficit = 0;
 				// If the windows system, continue to probe whether the data readable
 #if defined (EMC_WINDOWS)
 				tcp_set_event(area, client, EMC_READ);
@@ -563,16 +1064,246 @@ static void process_recv(struct tcp * tcp_, struct tcp_area * area, int id){
 				if(!client->rupk){
 					client->rupk = global_alloc_unapck();
 				}
+				client->rbytes += nread;
+				msgs = client->rmsgs;
 				if(client->rupk){
 					unpack_add(client->rupk, buffer, nread);
 					unpack_get(client->rupk, tcp_unpack_cb, id, tcp_, buffer);
 				}
+				client->rdeficit -= nread + (client->rmsgs - msgs) * TCP_MSG_COST;
+			}
+		}
+	}
+}
+
+// Subcontracting send data
+// Compress the payload of a data frame into dst,0 when it is sent as it is.
+// The caller holds client->sending
+static int tcp_data_compress(struct tcp_client * client, struct tcp_data * data, char * src, uint length, char * dst){
+	int packed = 0;
+	if(client->codec && EMC_CMD_DATA == data->cmd && length >= client->zmin){
+		if(client->zskip){
+			client->zskip --;
+		}else{
+			// Worth it only when a sixteenth is saved
+			packed = compress_data(client->codec, src, length, dst, length - length / 16);
+			if(packed > 0){
+				client->zmiss = 0;
+			}else if(++ client->zmiss >= TCP_COMPRESS_MISSES){
+				// Incompressible stream,stop paying for the codec for a while
+				client->zskip = TCP_COMPRESS_SKIP;
+				client->zmiss = 0;
+			}
+		}
+	}
+	return packed > 0 ? packed : 0;
+}
+
+// Single frame data in a compact frame,the logo and a varint of the payload length 
+// with the compressed flag in the lowest bit,then the bare payload
+static int tcp_data_compact(struct tcp_client * client, struct tcp_data * data, char * buffer){
+	uint length = data->lave, value = 0, head = sizeof(ushort);
+	char * src = (char *)emc_msg_buffer(data->msg);
+	char * payload = buffer + TCP_COMPACT_HEAD;
+	int packed = tcp_data_compress(client, data, src, length, payload);
+
+	if(packed > 0){
+		value = ((uint)packed << 1) | 1;
+	}else{
+		memcpy(payload, src, length);
+		packed = length;
+		value = (uint)packed << 1;
+	}
+	*(ushort *)buffer = EMC_HEAD_COMPACT;
+	do{
+		*(uchar *)(buffer + head ++) = (uchar)((value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+		value >>= 7;
+	}while(value);
+	if(head < TCP_COMPACT_HEAD){
+		memmove(buffer + head, payload, packed);
+	}
+	data->lave = 0;
+	return head + packed;
+}
+
+// Cut the next frame of the data into the buffer,the payload compressed when it shrinks.
+// The caller holds client->sending
+static int tcp_data_sep(struct tcp_client * client, struct tcp_data * data, char * buffer){
+	uint length = data->lave > TCP_DATA_SIZE?TCP_DATA_SIZE:data->lave;
+	char * src = (char *)emc_msg_buffer(data->msg) + (data->len - data->lave);
+	char * payload = buffer + sizeof(uint) + sizeof(struct tcp_data_unit);
+	int packed = 0;
+
+	if(client->compact && EMC_CMD_DATA == data->cmd && data->len <= TCP_DATA_SIZE){
+		return tcp_data_compact(client, data, buffer);
+	}
+	*(ushort *)buffer = EMC_HEAD;
+	((struct tcp_data_unit *)(buffer + sizeof(uint)))->cmd = data->cmd;
+	((struct tcp_data_unit *)(buffer + sizeof(uint)))->serial = data->serial;
+	((struct tcp_data_unit *)(buffer + sizeof(uint)))->total = data->len;
+	((struct tcp_data_unit *)(buffer + sizeof(uint)))->no = (data->len-data->lave)/TCP_DATA_SIZE;
+	packed = tcp_data_compress(client, data, src, length, payload);
+	if(packed > 0){
+		*(ushort *)(buffer + sizeof(ushort)) = (packed + sizeof(struct tcp_data_unit)) | TCP_COMPRESSED;
+	}else{
+		*(ushort *)(buffer + sizeof(ushort)) = length + sizeof(struct tcp_data_unit);
+		memcpy(payload, src, length);
+		packed = length;
+	}
+	data->lave -= length;
+	return packed + sizeof(struct tcp_data_unit) + sizeof(uint);
+}
+
+// Returns the number of bytes written, 0 if the socket would block, -1 on error
+static int tcp_send_buffer(int fd, char * buffer, int len){
+	int nsend = 0;
+#if defined (EMC_WINDOWS)
+	nsend = send(fd, buffer, len, 0);
+#else
+	nsend = send(fd, buffer, len, MSG_NOSIGNAL);
+#endif
+	if(nsend < 0){
+#if defined (EMC_WINDOWS)
+		if(WSAEWOULDBLOCK == WSAGetLastError()){
+#else
+		// EINPROGRESS,a fast open connection is still waiting for the syn to be answered
+		if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN || errno == EINPROGRESS){
+#endif
+			return 0;
+		}
+		return -1;
+	}
+	return nsend;
+}
+
+#if defined (TCP_ZEROCOPY)
+// Enable zero copy sends on the socket if the device asks for it
+static void tcp_set_zerocopy(struct tcp * tcp_, struct tcp_client * client){
+	int flag = 1;
+	client->zcopy = get_device_zerocopy(tcp_->mgr->device) &&
+		0 == setsockopt(client->fd, SOL_SOCKET, SO_ZEROCOPY, (char *)&flag, sizeof(int));
+}
+
+// Build all frame headers of the message,the kernel reads them until the completion
+static int tcp_zerocopy_init(struct tcp_data * data){
+	uint frames = (data->len + TCP_DATA_SIZE - 1) / TCP_DATA_SIZE, index = 0, length = 0;
+	char * header = NULL;
+
+	data->hdr = (char *)malloc(frames * TCP_HEAD_SIZE);
+	if(!data->hdr) return -1;
+	for(index = 0; index < frames; index ++){
+		length = data->len - index * TCP_DATA_SIZE;
+		if(length > TCP_DATA_SIZE) length = TCP_DATA_SIZE;
+		header = data->hdr + index * TCP_HEAD_SIZE;
+		*(ushort *)header = EMC_HEAD;
+		*(ushort *)(header + sizeof(ushort)) = length + sizeof(struct tcp_data_unit);
+		((struct tcp_data_unit *)(header + sizeof(uint)))->cmd = data->cmd;
+		((struct tcp_data_unit *)(header + sizeof(uint)))->serial = data->serial;
+		((struct tcp_data_unit *)(header + sizeof(uint)))->total = data->len;
+		((struct tcp_data_unit *)(header + sizeof(uint)))->no = index;
+	}
+	return 0;
+}
+
+// Send the message straight from its buffer,the frames being header and payload pairs.
+// Returns 2 all data was handed to the kernel, 1 the socket would block, -1 on error
+static int tcp_write_zerocopy(struct tcp_client * client, struct tcp_data * data){
+	struct iovec iov[TCP_IOV_SIZE];
+	struct msghdr mh;
+	uint frames = (data->len + TCP_DATA_SIZE - 1) / TCP_DATA_SIZE;
+	uint total = data->len + frames * TCP_HEAD_SIZE;
+	uint frame = 0, offset = 0, length = 0, count = 0;
+	int nsend = 0;
+
+	while(data->sent < total){
+		count = 0;
+		frame = data->sent / (TCP_HEAD_SIZE + TCP_DATA_SIZE);
+		offset = data->sent % (TCP_HEAD_SIZE + TCP_DATA_SIZE);
+		while(count + 2 <= TCP_IOV_SIZE && frame < frames){
+			length = data->len - frame * TCP_DATA_SIZE;
+			if(length > TCP_DATA_SIZE) length = TCP_DATA_SIZE;
+			if(offset < TCP_HEAD_SIZE){
+				iov[count].iov_base = data->hdr + frame * TCP_HEAD_SIZE + offset;
+				iov[count ++].iov_len = TCP_HEAD_SIZE - offset;
+				offset = 0;
+			}else{
+				offset -= TCP_HEAD_SIZE;
+			}
+			iov[count].iov_base = (char *)emc_msg_buffer(data->msg) + frame * TCP_DATA_SIZE + offset;
+			iov[count ++].iov_len = length - offset;
+			offset = 0;
+			frame ++;
+		}
+		memset(&mh, 0, sizeof(struct msghdr));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = count;
+		nsend = sendmsg(client->fd, &mh, MSG_ZEROCOPY | MSG_NOSIGNAL);
+		if(nsend < 0){
+			// ENOBUFS,too many completions are outstanding
+			if(errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN || errno == ENOBUFS){
+				return 1;
+			}
+			return -1;
+		}
+		// Each send that queued data takes the next completion key
+		data->zckey = client->zckey ++;
+		data->sent += nsend;
+		client->wbytes += nsend;
+	}
+	data->lave = 0;
+	client->wmsgs ++;
+	emc_queue_insert_tail(&client->zcq, &data->link);
+	return 2;
+}
+#endif
+
+// Write data to the socket, the caller must hold client->sending.
+// Returns 0 all data was written, 1 the socket would block, 
+// 2 written by zero copy and released on the completion, -1 on error
+static int tcp_write_data(struct tcp_client * client, struct tcp_data * data){
+	int nsend = 0, length = 0;
+	char buffer[MAX_PROTOCOL_SIZE];
+
+	while(client->wpos < client->wlen || data->lave > 0){
+		if(client->wpos < client->wlen){
+			// Finish the frame left by the last partial write
+			nsend = tcp_send_buffer(client->fd, client->wbuf + client->wpos, client->wlen - client->wpos);
+			if(nsend < 0) return -1;
+			if(0 == nsend) return 1;
+			client->wpos += nsend;
+			client->wbytes += nsend;
+			continue;
+		}
+#if defined (TCP_ZEROCOPY)
+		if(data->hdr){
+			return tcp_write_zerocopy(client, data);
+		}
+#endif
+		length = tcp_data_sep(client, data, buffer);
+		nsend = tcp_send_buffer(client->fd, buffer, length);
+		if(nsend < 0) return -1;
+		client->wbytes += nsend;
+		if(nsend < length){
+			if(!client->wbuf){
+				client->wbuf = (char *)malloc(MAX_PROTOCOL_SIZE);
+				if(!client->wbuf) return -1;
 			}
+			memcpy(client->wbuf, buffer + nsend, length - nsend);
+			client->wlen = length - nsend;
+			client->wpos = 0;
+			return 1;
 		}
 	}
+	client->wmsgs ++;
+	return 0;
 }
 
 static int tcp_send_data(struct tcp * tcp_, struct tcp_client * client, uchar cmd, int flag, void * msg){
+	int result = 0, id = -1;
+	struct uniquequeue * wmq = NULL;
+#if defined (TCP_ZEROCOPY)
+	uint threshold = 0;
+#endif
 	struct tcp_data * data = (struct tcp_data *)malloc(sizeof(struct tcp_data));
 	if(!data) return -1;
 
@@ -581,20 +1312,78 @@ static int tcp_send_data(struct tcp * tcp_, struct tcp_client * client, uchar cm
 	data->cmd = cmd;
 	data->serial = emc_msg_serial(msg);
 	data->ori = emc_msg_length(msg);
-	// Data compression can be performed here
+	// Frames are compressed one by one as they are cut,see tcp_data_sep
 	data->lave = data->len = data->ori;
 	data->msg = msg;
-	if(emc_msg_ref_add(msg) < 0) return -1;
+	data->hdr = NULL;
+	data->sent = data->zckey = 0;
+#if defined (TCP_ZEROCOPY)
+	// Large messages go out from their own buffer
+	threshold = get_device_zerocopy(tcp_->mgr->device);
+	if(client->zcopy && threshold && data->len >= threshold && tcp_zerocopy_init(data) < 0){
+		free(data);
+		return -1;
+	}
+#endif
+	if(emc_msg_ref_add(msg) < 0){
+		tcp_free_data(data);
+		return -1;
+	}
+	// Idle connection, write it from this thread instead of waking the send thread
+	if(TCP_STATE_OPEN <= client->state && EMC_PUB != emc_msg_get_mode(msg) && get_device_inline(tcp_->mgr->device) &&
+		0 == tcp_number_cas(&client->sending, 0, 1)){
+		// A close may have run between the test and the lock,the socket and the queue are gone then
+		if(TCP_STATE_OPEN > client->state || client->fd < 0){
+			emc_unlock(&client->sending);
+			emc_msg_ref_dec(msg);
+			tcp_free_data(data);
+			errno = ENOLIVE;
+			return -1;
+		}
+		if(global_empty_sendqueue(client->id)){
+			result = tcp_write_data(client, data);
+#if defined (TCP_CORK)
+			tcp_uncork(client);
+#endif
+			if(0 == result){
+				if(EMC_CMD_DATA == cmd){
+					tcp_post_monitor(tcp_, client, EMC_EVENT_SNDSUCC, msg);
+				}
+				emc_msg_set_result(msg, 1);
+				emc_msg_ref_dec(msg);
+				tcp_release_msg(data);
+				emc_unlock(&client->sending);
+				return 0;
+			}
+			if(2 == result){
+				emc_unlock(&client->sending);
+				return 0;
+			}
+			// The remainder or the error is left to the send thread
+			if(global_push_head_sendqueue(client->id, data) < 0){
+				emc_unlock(&client->sending);
+				emc_msg_ref_dec(msg);
+				tcp_free_data(data);
+				return -1;
+			}
+			// The client is not read once the lock is released
+			wmq = client->area->wmq;
+			id = client->id;
+			emc_unlock(&client->sending);
+			push_uqueue(wmq, id, tcp_);
+			return 0;
+		}
+		emc_unlock(&client->sending);
+	}
 	if(global_push_sendqueue(client->id, data) < 0){
 		post_uqueue(client->area->wmq);
 		emc_msg_ref_dec(msg);
-		free(data);
+		tcp_free_data(data);
 		return -1;
 	}else{
 		if(push_uqueue(client->area->wmq, client->id, client->tcp_) < 0){
-			data->flag = EMC_DEAD;
 			emc_msg_ref_dec(msg);
-			free(data);
+			tcp_free_data(data);
 			return -1;
 		}
 	}
@@ -604,7 +1393,7 @@ static int tcp_send_data(struct tcp * tcp_, struct tcp_client * client, uchar cm
 // Push data to all subscribers end
 static uint tcp_pub_foreach_cb(struct hashmap * m, int key, void * p, void * addition){
 	struct tcp_unit * unit = (struct tcp_unit *)addition;
-	if(EMC_SUB == ((struct tcp_client *)p)->mode && ((struct tcp_client *)p)->connected){
+	if(EMC_SUB == ((struct tcp_client *)p)->mode && TCP_STATE_OPEN <= ((struct tcp_client *)p)->state){
 		if(tcp_send_data(unit->tcp_,(struct tcp_client *)p, EMC_CMD_DATA, unit->wait, unit->msg) < 0){
 			tcp_post_monitor(unit->tcp_, (struct tcp_client *)p, EMC_EVENT_SNDFAIL, unit->msg);
 		}
@@ -612,24 +1401,10 @@ static uint tcp_pub_foreach_cb(struct hashmap * m, int key, void * p, void * add
 	return 0;
 }
 
-// Subcontracting send data
-static int tcp_data_sep(struct tcp_data * data, char * buffer, int id){
-	*(ushort *)buffer = EMC_HEAD;
-	*(ushort *)(buffer + sizeof(ushort)) = data->lave>TCP_DATA_SIZE?MAX_DATA_SIZE:(data->lave + sizeof(struct tcp_data_unit));
-	((struct tcp_data_unit *)(buffer + sizeof(uint)))->cmd = data->cmd;
-	((struct tcp_data_unit *)(buffer + sizeof(uint)))->serial = data->serial;
-	((struct tcp_data_unit *)(buffer + sizeof(uint)))->total = data->len;
-	((struct tcp_data_unit *)(buffer + sizeof(uint)))->no = (data->len-data->lave)/TCP_DATA_SIZE;
-	memcpy(buffer + sizeof(uint) + sizeof(struct tcp_data_unit), (char *)emc_msg_buffer(data->msg) + (data->len - data->lave),
-		data->lave > TCP_DATA_SIZE?TCP_DATA_SIZE:data->lave);
-	return data->lave > TCP_DATA_SIZE?MAX_PROTOCOL_SIZE:(data->lave + sizeof(struct tcp_data_unit) + sizeof(uint));
-}
-
 static int process_send(struct tcp * tcp_, struct tcp_area * area, int id){
 	struct tcp_client * client = NULL;
 	struct tcp_data * data = NULL;
-	int nsend = -1, length = 0;
-	char buffer[MAX_PROTOCOL_SIZE] = {0};
+	int result = 0;
 
 	if(EMC_LIVE != tcp_->flag) return -1;
 	if(EMC_LOCAL == tcp_->type){
@@ -643,55 +1418,51 @@ static int process_send(struct tcp * tcp_, struct tcp_area * area, int id){
 		// Failed to send notification messages
 		return -1;
 	}
+	emc_lock(&client->sending);
+	// The connection may have been moved to another area
+	area = client->area;
+	client->wdeficit += client->quantum;
 	while(1){
+		if(client->wdeficit <= 0){
+			// Quantum spent,back to the tail of the area queue
+			push_uqueue(area->wmq, id, tcp_);
+			break;
+		}
 		if(global_pop_sendqueue(id, (void **)&data) < 0 || !data || EMC_LIVE != data->flag){
+			// Queue drained,no credit is carried to the next turn
+			client->wdeficit = 0;
 			break;
 		}
-		while(data->lave > 0){
-			length = tcp_data_sep(data, buffer, id);
-#if defined (EMC_WINDOWS)
-			nsend = send(client->fd, buffer, length, 0);
-#else
-			nsend = send(client->fd, buffer, length, MSG_NOSIGNAL);
-#endif
-			if(nsend < 0){
-#if defined (EMC_WINDOWS)
-				if(WSAEWOULDBLOCK == WSAGetLastError()){
-#else
-				if (errno == EINTR || errno == EWOULDBLOCK || errno == EAGAIN){
-#endif
-					// Transmission fails, the data added to the queue
-					if(global_push_head_sendqueue(id, data) < 0){
-						// If you set the monitor option throws up send failure message
-						if(EMC_CMD_DATA == data->cmd){
-							tcp_post_monitor(tcp_, client, EMC_EVENT_SNDFAIL, data->msg);
-						}
-						emc_msg_ref_dec(data->msg);
-						// Join transmit queue fails, check whether the message reference count is 0, then consider the release of the message buffer
-						tcp_release_msg(data);
-						return -1;
-					}
-					push_uqueue(area->wmq, id, tcp_);
-					return -1;
-				}
-				emc_msg_ref_dec(data->msg);
+		client->wdeficit -= data->len + TCP_MSG_COST;
+		result = tcp_write_data(client, data);
+		if(2 == result){
+			// Zero copy,released when the kernel reports the completion
+			continue;
+		}else if(result > 0){
+			// Transmission fails, the data added to the queue
+			if(global_push_head_sendqueue(id, data) < 0){
+				emc_unlock(&client->sending);
+				// If you set the monitor option throws up send failure message
 				if(EMC_CMD_DATA == data->cmd){
 					tcp_post_monitor(tcp_, client, EMC_EVENT_SNDFAIL, data->msg);
 				}
-				tcp_release_msg(data);
-				process_close(tcp_,area, id);
-				return -1;
-			}else if(0 == nsend){
 				emc_msg_ref_dec(data->msg);
-				if(EMC_CMD_DATA == data->cmd){
-					tcp_post_monitor(tcp_, client, EMC_EVENT_SNDFAIL, data->msg);
-				}
+				// Join transmit queue fails, check whether the message reference count is 0, then consider the release of the message buffer
 				tcp_release_msg(data);
-				process_close(tcp_, area, id);
 				return -1;
-			}else{
-				data->lave -= (nsend-sizeof(uint)-sizeof(struct tcp_data_unit));
 			}
+			emc_unlock(&client->sending);
+			push_uqueue(area->wmq, id, tcp_);
+			return -1;
+		}else if(result < 0){
+			emc_unlock(&client->sending);
+			emc_msg_ref_dec(data->msg);
+			if(EMC_CMD_DATA == data->cmd){
+				tcp_post_monitor(tcp_, client, EMC_EVENT_SNDFAIL, data->msg);
+			}
+			tcp_release_msg(data);
+			process_close(tcp_,area, id);
+			return -1;
 		}
 		// If you set the monitor option throws up send success message
 		if(EMC_CMD_DATA == data->cmd){
@@ -701,26 +1472,26 @@ static int process_send(struct tcp * tcp_, struct tcp_area * area, int id){
 		emc_msg_ref_dec(data->msg);
 		tcp_release_msg(data);
 	}
+#if defined (TCP_CORK)
+	tcp_uncork(client);
+#endif
+	emc_unlock(&client->sending);
 	return 0;
 }
 
-static int process_accept(struct tcp * tcp_, struct tcp_area * area, int fd, char * addr, ushort port){
-	int flag=1, size=0x10000;
+static int process_accept(struct tcp * tcp_, struct tcp_area * area, int fd, int family, char * addr, ushort port){
+#if defined (EMC_WINDOWS)
+	int flag=1;
+#endif
 	struct tcp_client * client = NULL;
 
+	// Linux accepted sockets are already non-blocking and inherit the listener options
+#if defined (EMC_WINDOWS)
 	if(_nonblocking(fd, flag) < 0){
 		_close_socket(fd);
 		return -1;
 	}
-	if(tcp_set_keepalive(fd) < 0){
-		_close_socket(fd);
-		return -1;
-	}
-	if(setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(int)) < 0){
-		_close_socket(fd);
-		return -1;
-	}
-	if(setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(int)) < 0){
+	if(tcp_set_options(tcp_, fd, family) < 0){
 		_close_socket(fd);
 		return -1;
 	}
@@ -728,39 +1499,257 @@ static int process_accept(struct tcp * tcp_, struct tcp_area * area, int fd, cha
 		_close_socket(fd);
 		return -1;
 	}
+#endif
 	client = (struct tcp_client*)malloc(sizeof(struct tcp_client));
 	if(!client){
 		_close_socket(fd);
 		return -1;
 	}
 	memset(client, 0, sizeof(struct tcp_client));
+	emc_queue_init(&client->zcq);
 	strncpy(client->ip, addr, ADDR_LEN);
 	client->port = port;
 	client->fd = fd;
 	client->area = area;
 	client->tcp_ = tcp_;
 	client->id = global_get_connect_id();
-	client->completed = 0;
-	if(tcp_add_event(area, client, EMC_READ) < 0){
+	client->family = family;
+	client->cork = AF_UNIX != family && get_plug_option(tcp_->plug, EMC_PLUG_CORK) > 0;
+	client->zmin = get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS_MIN) > 0 ?
+		get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS_MIN) : TCP_COMPRESS_MIN;
+	client->quantum = get_plug_option(tcp_->plug, EMC_PLUG_QUANTUM) > 0 ?
+		get_plug_option(tcp_->plug, EMC_PLUG_QUANTUM) : TCP_QUANTUM;
+#if defined (TCP_UNIX)
+	if(AF_UNIX == family){
+		tcp_peer_cred(client);
+	}
+#endif
+#if defined (TCP_ZEROCOPY)
+	tcp_set_zerocopy(tcp_, client);
+#endif
+	// Open before the reactor sees the socket,the first frames may already be there
+	client->state = TCP_STATE_OPEN;
+	if(hashmap_insert(tcp_->server->connection, client->id, client) < 0){
 		global_idle_connect_id(client->id);
 		free(client);
 		_close_socket(fd);
 		return -1;
 	}
-	if(hashmap_insert(tcp_->server->connection, client->id, client) < 0){
+	tcp_area_attach(area, client);
+	if(tcp_add_event(area, client, EMC_READ) < 0){
+		tcp_area_detach(client);
+		hashmap_erase(tcp_->server->connection, client->id);
 		global_idle_connect_id(client->id);
 		free(client);
 		_close_socket(fd);
 		return -1;
 	}
-	client->connected = 1;
-	area->count ++;
 	tcp_post_monitor(tcp_, client, EMC_EVENT_ACCEPT, NULL);
-	tcp_number_add(&client->completed);
 	return 0;
 }
 
+#if defined (TCP_ZEROCOPY)
+// Read the zero copy completions from the socket error queue
+static void process_error(struct tcp * tcp_, struct tcp_area * area, int id){
+	struct tcp_client * client = NULL;
+	struct msghdr mh;
+	struct cmsghdr * cm = NULL;
+	struct sock_extended_err * serr = NULL;
+	char control[128];
+
+	if(EMC_LIVE != tcp_->flag) return;
+	if(EMC_LOCAL == tcp_->type){
+		client = (struct tcp_client *)hashmap_search(tcp_->server->connection, id);
+	}else if(EMC_REMOTE == tcp_->type){
+		if(tcp_->client->id == id){
+			client = tcp_->client;
+		}
+	}
+	if(!client) return;
+	emc_lock(&client->sending);
+	while(1){
+		memset(&mh, 0, sizeof(struct msghdr));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		if(recvmsg(client->fd, &mh, MSG_ERRQUEUE) < 0){
+			break;
+		}
+		for(cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)){
+			if(!(SOL_IP == cm->cmsg_level && IP_RECVERR == cm->cmsg_type) &&
+				!(SOL_IPV6 == cm->cmsg_level && IPV6_RECVERR == cm->cmsg_type)){
+				continue;
+			}
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if(SO_EE_ORIGIN_ZEROCOPY != serr->ee_origin || serr->ee_errno){
+				continue;
+			}
+			// The kernel copied the data anyway,zero copy only costs on this route
+			if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED){
+				client->zcopy = 0;
+			}
+			tcp_zerocopy_done(tcp_, client, serr->ee_data, 1);
+		}
+	}
+	emc_unlock(&client->sending);
+}
+#endif
+
+#if !defined (EMC_WINDOWS)
+// The socket of a connection attempt became writable or failed
+static void process_connect(struct tcp * tcp_, struct tcp_area * area, struct tcp_client * client){
+	struct sockaddr_storage addr;
+	socklen_t len = sizeof(struct sockaddr_storage);
+	int erro = 0;
+	socklen_t erro_len = sizeof(int);
+
+	if(EMC_LIVE != tcp_->flag) return;
+	emc_lock(&client->sending);
+	if(TCP_STATE_CONNECTING != client->state){
+		emc_unlock(&client->sending);
+		return;
+	}
+	if(getsockopt(client->fd, SOL_SOCKET, SO_ERROR, (char*)&erro, &erro_len) < 0 || 0 != erro){
+		client->state = TCP_STATE_CLOSED;
+		tcp_del_event(tcp_, area, client->fd);
+		_close_socket(client->fd);
+		client->fd = -1;
+		tcp_backoff(client);
+		emc_unlock(&client->sending);
+		return;
+	}
+	// A stale event of an earlier attempt,this one is still in progress
+	if(getpeername(client->fd, (struct sockaddr *)&addr, &len) < 0 ||
+		tcp_set_event(area, client, EMC_READ) < 0){
+		emc_unlock(&client->sending);
+		return;
+	}
+	emc_unlock(&client->sending);
+	tcp_connect_done(tcp_);
+}
+
+// Drain the listen queue of a listener,a batch at a time
+static void process_listen(struct tcp * tcp_, struct tcp_client * listener){
+	int fd = -1, index = 0;
+	struct sockaddr_storage ss;
+	socklen_t len = 0;
+	char addr[ADDR_LEN] = {0};
+	ushort port = 0;
+	struct tcp_area * area = NULL;
+
+	// Held while accepting,so the listener is not closed under the batch
+	emc_lock(&listener->sending);
+	for(index = 0; index < TCP_ACCEPT_BATCH && EMC_LIVE == tcp_->flag; index ++){
+		len = sizeof(struct sockaddr_storage);
+		fd = accept4(listener->fd, (struct sockaddr *)&ss, &len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(fd < 0){
+			if(EINTR == errno) continue;
+			// Out of descriptors the connection stays queued and the listener keeps firing,
+			// it is refused through the reserved descriptor instead
+			if(EMFILE == errno || ENFILE == errno){
+				if(listener->area->reserve >= 0){
+					close(listener->area->reserve);
+					fd = accept(listener->fd, NULL, NULL);
+					if(fd >= 0){
+						close(fd);
+					}
+					listener->area->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+					continue;
+				}
+				// No reserve left,back off instead of spinning
+				listener->area->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+				nsleep(1);
+			}
+			// EAGAIN,the listen queue is empty
+			break;
+		}
+		if(AF_UNIX == listener->family){
+			strncpy(addr, "unix", ADDR_LEN);
+			port = tcp_->port;
+		}else{
+			port = tcp_addr_str(&ss, addr);
+		}
+		// A sharded listener keeps its connections on its own area
+		area = tcp_->server->shards > 1 && AF_UNIX != listener->family ? listener->area : tcp_least_thread(tcp_->mgr);
+		process_accept(tcp_, area, fd, listener->family, addr, port);
+	}
+	emc_unlock(&listener->sending);
+}
+#endif
+
+// Turn the traffic since the last sample into the load of the connections
+static void tcp_sample_area(struct tcp_area * area, int64 elapsed){
+	struct emc_queue * q = NULL;
+	struct tcp_client * client = NULL;
+	uint64 load = 0, rate = 0;
+
+	if(elapsed <= 0) return;
+	emc_lock(&area->mgr->lst_lck);
+	for(q = area->clients.next; q != &area->clients; q = q->next){
+		client = emc_queue_data(q, struct tcp_client, link);
+		rate = (uint64)client->rbytes + client->wbytes + ((uint64)client->rmsgs + client->wmsgs) * TCP_MSG_COST;
+		client->rbytes = client->wbytes = client->rmsgs = client->wmsgs = 0;
+		client->load = (client->load + rate * 1000 / elapsed) / 2;
+		load += client->load;
+	}
+	area->load = load;
+	emc_unlock(&area->mgr->lst_lck);
+}
+
+#if !defined (EMC_WINDOWS)
+// Move a connection to another area,the caller holds the list lock and client->sending.
+// Runs on the reactor of the current area,so no read of the connection is in progress
+static int tcp_migrate(struct tcp_client * client, struct tcp_area * target){
+	struct tcp_area * area = client->area;
+
+	if(tcp_add_event(target, client, EMC_READ) < 0){
+		return -1;
+	}
+	tcp_del_event(client->tcp_, area, client->fd);
+	emc_queue_remove(&client->link);
+	emc_queue_insert_tail(&target->clients, &client->link);
+	area->count --;
+	target->count ++;
+	area->load = area->load > client->load ? area->load - client->load : 0;
+	target->load += client->load;
+	client->area = target;
+	// Queued data keeps its order,the new area's send thread picks it up
+	if(!global_empty_sendqueue(client->id)){
+		push_uqueue(target->wmq, client->id, client->tcp_);
+	}
+	return 0;
+}
+
+// Hand the connection that best evens out the load to the least loaded area
+static void tcp_balance_area(struct tcp_area * area){
+	struct emc_queue * q = NULL;
+	struct tcp_client * client = NULL, * best = NULL;
+	struct tcp_area * target = tcp_least_thread(area->mgr);
+	uint64 diff = 0;
+
+	if(target == area || area->load < TCP_BALANCE_LOAD || area->load <= target->load * 2){
+		return;
+	}
+	diff = (area->load - target->load) / 2;
+	emc_lock(&area->mgr->lst_lck);
+	for(q = area->clients.next; q != &area->clients; q = q->next){
+		client = emc_queue_data(q, struct tcp_client, link);
+		if(client->load && client->load <= diff && (!best || client->load > best->load)){
+			best = client;
+		}
+	}
+	// A connection busy writing is left for the next round
+	if(best && TCP_STATE_OPEN <= best->state && 0 == tcp_number_cas(&best->sending, 0, 1)){
+		tcp_migrate(best, target);
+		emc_unlock(&best->sending);
+	}
+	emc_unlock(&area->mgr->lst_lck);
+}
+#endif
+
 static emc_cb_t EMC_CALL tcp_work_cb(void * args){
+	struct tcp_client * client = NULL;
+	int64 now = 0, active = 0;
+	int timeout = 1;
 #if defined (EMC_WINDOWS)
 	uint length = 0, key = 0;
 	struct tcp_ol *ol = NULL;
@@ -771,9 +1760,52 @@ static emc_cb_t EMC_CALL tcp_work_cb(void * args){
 	struct tcp_area	* area = (struct tcp_area *)args;
 	struct tcp_mgr * mgr = area->mgr;
 
+	// Bind first,then the poll and the queue of the area are allocated on the local numa node
+	if(area->cpu){
+		set_thread_affinity(area->cpu);
+	}
+#if defined (EMC_WINDOWS)
+	area->fd = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+	if(area->fd){
+		area->wmq = create_uqueue();
+	}
+#else
+	area->fd = epoll_create(EMC_SOCKETS_DEFAULT);
+	if(area->fd >= 0){
+		area->wmq = create_uqueue();
+	}
+#endif
+	if(!area->wmq){
+		// Without its poll or its queue the area cannot serve,init_tcp_mgr gives up
+#if defined (EMC_WINDOWS)
+		if(area->fd){
+			CloseHandle(area->fd);
+			area->fd = NULL;
+		}
+#else
+		if(area->fd >= 0){
+			close(area->fd);
+			area->fd = -1;
+		}
+#endif
+		area->ready = 1;
+		return (emc_cb_t)0;
+	}
+#if !defined (EMC_WINDOWS)
+	area->reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+#endif
+	area->ready = 1;
 	while(!mgr->exit){
+		// Spin while within the busy poll budget of the last activity
+		timeout = 1;
+		if(area->budget && time_get_micro() - active < area->budget){
+			timeout = 0;
+		}
 #if defined (EMC_WINDOWS)
-		if(GetQueuedCompletionStatus(area->fd, (LPDWORD)&length, (PULONG_PTR)&key, (LPOVERLAPPED *)&ol, 1)){
+		if(GetQueuedCompletionStatus(area->fd, (LPDWORD)&length, (PULONG_PTR)&key, (LPOVERLAPPED *)&ol, timeout)){
+			if(area->budget){
+				active = time_get_micro();
+			}
 			if(key < EMC_SOCKETS_DEFAULT){
 				if(ol){
 					if(STATUS_REMOTE_DISCONNECT == ol->ol.Internal ||
@@ -806,21 +1838,56 @@ static emc_cb_t EMC_CALL tcp_work_cb(void * args){
 			}
 		}
 #else
-		retval = epoll_wait(area->fd, events, TCP_FD_SIZE, 1);
+		retval = epoll_wait(area->fd, events, TCP_FD_SIZE, timeout);
 		if(retval > 0){
 			int j = 0;
+			if(area->budget){
+				active = time_get_micro();
+			}
 			for (j = 0; j < retval; j ++){
-				id = ((struct tcp_client *)events[j].data.ptr)->id;
+				client = (struct tcp_client *)events[j].data.ptr;
+				if(client->listener){
+					if(client->tcp_){
+						process_listen(client->tcp_, client);
+					}
+					continue;
+				}
+				if(TCP_STATE_CONNECTING == client->state){
+					if(client->tcp_){
+						process_connect(client->tcp_, area, client);
+					}
+					continue;
+				}
+				id = client->id;
 				if(id >= 0 && id < EMC_SOCKETS_DEFAULT){
+#if defined (TCP_ZEROCOPY)
+					if(events[j].events & EPOLLERR){
+						if(client->tcp_){
+							process_error(client->tcp_, area, id);
+						}
+					}
+#endif
 					if(events[j].events & EPOLLIN){
-						if(events[j].data.ptr && ((struct tcp_client *)events[j].data.ptr)->tcp_){
-							process_recv(((struct tcp_client *)events[j].data.ptr)->tcp_, area, id);
+						if(client->tcp_){
+							process_recv(client->tcp_, area, id);
 						}
 					}
 				}
 			}
 		}
 #endif
+		area->passes ++;
+		now = time_get_time();
+		if(now - area->sample >= TCP_SAMPLE_TIME){
+			tcp_sample_area(area, now - area->sample);
+			area->sample = now;
+			area->budget = get_device_busypoll(mgr->device);
+#if !defined (EMC_WINDOWS)
+			if(get_device_balance(mgr->device)){
+				tcp_balance_area(area);
+			}
+#endif
+		}
 	}
 	return (emc_cb_t)0;
 }
@@ -830,97 +1897,351 @@ static emc_cb_t EMC_CALL tcp_send_cb(void * args){
 	struct tcp_mgr * mgr = area->mgr;
 	struct tcp * tcp_ = NULL;
 	int id = -1;
+	int64 active = 0;
+	int spin = 2;
 
 	while(!mgr->exit){
-		wait_uqueue(area->wmq, 1);
+		// With busy poll both threads of the area spin,the send thread then runs on the cpus of the device
+		// instead of taking turns with the work thread on its cpu
+		if(area->cpu && spin != (area->budget ? 1 : 0)){
+			spin = area->budget ? 1 : 0;
+			set_thread_affinity(spin ? get_device_affinity(mgr->device) : area->cpu);
+		}
+		// Poll the queue without sleeping while within the busy poll budget
+		if(!area->budget || time_get_micro() - active >= area->budget){
+			wait_uqueue(area->wmq, 1);
+		}
 		while((id = pop_uqueue(area->wmq, (void **)&tcp_)) >= 0){
 			process_send(tcp_, area, id);
+			if(area->budget){
+				active = time_get_micro();
+			}
 		}
 	}
 	return (emc_cb_t)0;
 }
 
+#if defined (EMC_WINDOWS)
 static emc_cb_t EMC_CALL tcp_accept_cb(void * args){
 	struct tcp * tcp_ = (struct tcp *)args;
 	struct tcp_area * area = NULL;
-	struct sockaddr_in sa = {0};
-	int fd = -1, len = sizeof(struct sockaddr_in);
+	struct sockaddr_storage sa = {0};
+	char addr[ADDR_LEN] = {0};
+	ushort port = 0;
+	int fd = -1, len = sizeof(struct sockaddr_storage);
+	if(get_device_affinity(tcp_->mgr->device)){
+		set_thread_affinity(get_device_affinity(tcp_->mgr->device));
+	}
 	while(!tcp_->exit){
-		fd = accept(tcp_->server->fd, (struct sockaddr*)&sa, &len);
+		len = sizeof(struct sockaddr_storage);
+		fd = accept(tcp_->server->listener[0]->fd, (struct sockaddr*)&sa, &len);
 		if(fd > 0){
 			area = tcp_least_thread(tcp_->mgr);
-			process_accept(tcp_, area, fd, inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+			port = tcp_addr_str(&sa, addr);
+			process_accept(tcp_, area, fd, tcp_->addr.ss_family, addr, port);
 		}
 	}
 	return (emc_cb_t)0;
 }
+#endif
 
 static uint tcp_close_cb(struct hashmap * m, int id, void * p, void * addition){
 	_close_socket(((struct tcp_client *)p)->fd);
 	return 0;
 }
 
-// Tcp server initialization
-static int init_tcp_server(struct tcp * tcp_){
-	int flag = 0;
-	struct sockaddr_in	addr = {0};
+// Open a listening socket on the address of the plug
+static int tcp_listen(struct tcp * tcp_, int reuseport, int backlog){
+	int flag = 0, fd = -1;
+
+#if defined (EMC_WINDOWS)
+	fd = socket(tcp_->addr.ss_family, SOCK_STREAM, 0);
+#else
+	fd = socket(tcp_->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+#endif
+	if(fd < 0){
+		errno = ENOSOCK;
+		return -1;
+	}
+	// Dual stack,the ipv4 connections arrive as mapped ipv6 addresses
+	if(AF_INET6 == tcp_->addr.ss_family &&
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&flag, sizeof(flag)) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag)) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+#if !defined (EMC_WINDOWS)
+	// Accepted sockets inherit these,so accept does not have to set them one by one
+	if(tcp_set_options(tcp_, fd, tcp_->addr.ss_family) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if(get_device_busypoll(tcp_->mgr->device)){
+		tcp_set_busypoll(fd, get_device_busypoll(tcp_->mgr->device));
+	}
+#if defined (TCP_FASTOPEN)
+	// Hand out fast open cookies to the clients,failing only costs a round trip
+	setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, (char *)&backlog, sizeof(int));
+#endif
+#if defined (SO_REUSEPORT)
+	flag = 1;
+	if(reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *)&flag, sizeof(flag)) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+#endif
+#endif
+	if(bind(fd, (struct sockaddr *)&tcp_->addr, tcp_->addrlen) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	if(listen(fd, backlog) < 0){
+		_close_socket(fd);
+		errno = EINVAL;
+		return -1;
+	}
+	return fd;
+}
+
+#if defined (TCP_UNIX)
+static int tcp_listen_unix(struct tcp * tcp_, int backlog){
+	int fd = -1;
+	struct sockaddr_un addr;
+	socklen_t len = tcp_unix_addr(tcp_->path, &addr);
 
-	tcp_->server->fd = socket(AF_INET, SOCK_STREAM, 0);
-	if(tcp_->server->fd < 0){
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0){
 		errno = ENOSOCK;
 		return -1;
 	}
-	if(setsockopt(tcp_->server->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag)) < 0){
-		_close_socket(tcp_->server->fd);
+	if(tcp_set_options(tcp_, fd, AF_UNIX) < 0){
+		_close_socket(fd);
 		errno = EINVAL;
 		return -1;
 	}
-	addr.sin_family			= AF_INET;
-	addr.sin_addr.s_addr	= tcp_->ip?tcp_->ip:INADDR_ANY;
-	addr.sin_port			= htons(tcp_->port);
-	if(bind(tcp_->server->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
-		_close_socket(tcp_->server->fd);
+	// The file left by an earlier server would fail the bind
+	if('@' != tcp_->path[0]){
+		unlink(tcp_->path);
+	}
+	if(bind(fd, (struct sockaddr *)&addr, len) < 0){
+		_close_socket(fd);
 		errno = EINVAL;
 		return -1;
 	}
-	if(listen(tcp_->server->fd, 100) < 0){
-		_close_socket(tcp_->server->fd);
+	if(listen(fd, backlog) < 0){
+		_close_socket(fd);
 		errno = EINVAL;
 		return -1;
 	}
+	return fd;
+}
+#endif
+
+#if !defined (EMC_WINDOWS) && defined (SO_ATTACH_REUSEPORT_CBPF)
+// Hand a new connection to the listener of the cpu that received it
+static int tcp_steer_listener(int fd, uint count){
+	struct sock_filter code[] = {
+		{BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+		{BPF_ALU | BPF_MOD | BPF_K, 0, 0, count},
+		{BPF_RET | BPF_A, 0, 0, 0}
+	};
+	struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+	return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, (char *)&prog, sizeof(prog));
+}
+#endif
+
+#if !defined (EMC_WINDOWS)
+// Wait until every work thread has finished the event batch it was handling,
+// a socket removed from epoll before is referenced no more
+static void tcp_quiesce(struct tcp_mgr * mgr){
+	uint index = 0;
+	uint64 passes = 0;
+
+	for(index = 0; index < mgr->count; index ++){
+		passes = mgr->area[index].passes;
+		while(!mgr->exit && passes == mgr->area[index].passes){
+			nsleep(1);
+		}
+	}
+}
+#endif
+
+// Close all listening sockets of the server
+static void tcp_close_listener(struct tcp * tcp_){
+	uint index = 0;
+	struct tcp_client * listener = NULL;
+
+	for(index = 0; index < tcp_->server->listeners; index ++){
+		listener = tcp_->server->listener[index];
+		// Wait for the reactor to leave the accept batch
+		emc_lock(&listener->sending);
+#if !defined (EMC_WINDOWS)
+		tcp_del_event(tcp_, listener->area, listener->fd);
+#endif
+		_close_socket(listener->fd);
+		listener->fd = -1;
+		emc_unlock(&listener->sending);
+	}
+#if !defined (EMC_WINDOWS)
+	// A batch already taken by a reactor may still hold a listener,it is freed after
+	tcp_quiesce(tcp_->mgr);
+#endif
+}
+
+// Free the listening sockets of the server,closed before
+static void tcp_free_listener(struct tcp * tcp_){
+	uint index = 0;
+
+	for(index = 0; index < tcp_->server->listeners; index ++){
+		free(tcp_->server->listener[index]);
+	}
+	free(tcp_->server->listener);
+	tcp_->server->listener = NULL;
+	tcp_->server->listeners = 0;
+}
+
+// Tcp server initialization
+static int init_tcp_server(struct tcp * tcp_){
+	int fd = -1, backlog = get_plug_option(tcp_->plug, EMC_PLUG_BACKLOG);
+	int reuseport = get_plug_option(tcp_->plug, EMC_PLUG_REUSEPORT);
+	uint index = 0, count = 1, total = 0;
+	struct tcp_client * listener = NULL;
+
+	if(backlog <= 0){
+		backlog = TCP_BACKLOG;
+	}
+#if !defined (EMC_WINDOWS) && defined (SO_REUSEPORT)
+	// One listener per area,the kernel spreads the connections between them
+	if(reuseport > 0){
+		count = tcp_->mgr->count;
+	}
+#else
+	reuseport = 0;
+#endif
+	// A plug bound to a unix path only has no tcp port
+	if(!tcp_->port && tcp_->path[0]){
+		count = 0;
+	}
+	total = count;
+	if(tcp_->path[0]){
+#if defined (TCP_UNIX)
+		total ++;
+#else
+		errno = EINVAL;
+		return -1;
+#endif
+	}
+	tcp_->server->listener = (struct tcp_client **)malloc(sizeof(struct tcp_client *) * total);
+	if(!tcp_->server->listener){
+		errno = ENOMEM;
+		return -1;
+	}
+	memset(tcp_->server->listener, 0, sizeof(struct tcp_client *) * total);
+	tcp_->server->shards = count;
 	tcp_->server->connection = hashmap_new(EMC_SOCKETS_DEFAULT);
+	for(index = 0; index < total; index ++){
+		listener = (struct tcp_client *)malloc(sizeof(struct tcp_client));
+		if(!listener){
+			tcp_close_listener(tcp_);
+			hashmap_delete(tcp_->server->connection);
+			tcp_free_listener(tcp_);
+			errno = ENOMEM;
+			return -1;
+		}
+		memset(listener, 0, sizeof(struct tcp_client));
+#if defined (TCP_UNIX)
+		fd = index < count ? tcp_listen(tcp_, reuseport, backlog) : tcp_listen_unix(tcp_, backlog);
+#else
+		fd = tcp_listen(tcp_, reuseport, backlog);
+#endif
+		if(fd < 0){
+			free(listener);
+			tcp_close_listener(tcp_);
+			hashmap_delete(tcp_->server->connection);
+			tcp_free_listener(tcp_);
+			return -1;
+		}
+		tcp_->server->listener[index] = listener;
+		listener->id = -1;
+		listener->fd = fd;
+		listener->family = index < count ? tcp_->addr.ss_family : AF_UNIX;
+		listener->listener = 1;
+		listener->tcp_ = tcp_;
+		tcp_->server->listeners ++;
+#if !defined (EMC_WINDOWS)
+		// The listener is served by a reactor thread like any other socket
+		listener->area = reuseport > 0 && index < count ? tcp_->mgr->area + index : tcp_least_thread(tcp_->mgr);
+		if(tcp_add_event(listener->area, listener, EMC_READ) < 0){
+			tcp_close_listener(tcp_);
+			hashmap_delete(tcp_->server->connection);
+			tcp_free_listener(tcp_);
+			errno = EINVAL;
+			return -1;
+		}
+#endif
+	}
+#if !defined (EMC_WINDOWS) && defined (SO_ATTACH_REUSEPORT_CBPF)
+	// Without the program the kernel hashes the connections,so a failure is not fatal
+	if(reuseport > 1 && count > 1){
+		tcp_steer_listener(tcp_->server->listener[0]->fd, count);
+	}
+#endif
+#if defined (EMC_WINDOWS)
 	tcp_->server->taccept = emc_thread(tcp_accept_cb, tcp_);
+#endif
 	return 0;
 }
 
-// The client sends the login packet
+// The client sends the login packet,with the codec it asks for and the features it offers
 static void tcp_send_login(struct tcp * tcp_){
-	void * msg = emc_msg_alloc(NULL, sizeof(ushort));
+	int codec = get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS);
+	void * msg = emc_msg_alloc(NULL, sizeof(ushort) + 2 * sizeof(uchar));
 	emc_msg_setid(msg, tcp_->client->id);
 	*(ushort *)emc_msg_buffer(msg) = tcp_->client->mode;
+	*((uchar *)emc_msg_buffer(msg) + sizeof(ushort)) = compress_has(codec) ? (uchar)codec : 0;
+	*((uchar *)emc_msg_buffer(msg) + sizeof(ushort) + sizeof(uchar)) = TCP_FEATURE_COMPACT;
 	if(tcp_send_data(tcp_, tcp_->client, EMC_CMD_LOGIN, EMC_NOWAIT, msg) < 0){
 		emc_msg_free(msg);
 	}
 }
 
-// Tcp client initialization
+// Tcp client initialization,on linux the connection completes on the reactor
 static int init_tcp_client(struct tcp * tcp_){
 #if defined (EMC_WINDOWS)
 	fd_set rdset = {0}, wdset = {0};
 	struct timeval tv = {0};
-#else
-	struct pollfd fds;
+	int erro = 0, erro_len = sizeof(int), selecttime = 5;
 #endif
-	struct sockaddr_in	addr = {0};
-	int size = 0x10000, flag = 1, erro = 0, erro_len = sizeof(int), selecttime = 5;
+#if defined (TCP_UNIX)
+	struct sockaddr_un	uaddr;
+#endif
+	struct sockaddr * sa = (struct sockaddr *)&tcp_->addr;
+	socklen_t salen = tcp_->addrlen;
+	int flag = 1;
 
 	if(tcp_->client->id < 0){
 		tcp_->client->id = global_get_connect_id();
 	}
 
-	tcp_->client->completed = 0;
+	tcp_->client->state = TCP_STATE_CLOSED;
+	tcp_->client->codec = tcp_->client->zmiss = tcp_->client->zskip = 0;
+	tcp_->client->compact = 0;
+	tcp_->client->zmin = get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS_MIN) > 0 ?
+		get_plug_option(tcp_->plug, EMC_PLUG_COMPRESS_MIN) : TCP_COMPRESS_MIN;
+	tcp_->client->quantum = get_plug_option(tcp_->plug, EMC_PLUG_QUANTUM) > 0 ?
+		get_plug_option(tcp_->plug, EMC_PLUG_QUANTUM) : TCP_QUANTUM;
+	tcp_->client->rdeficit = tcp_->client->wdeficit = 0;
 	tcp_->client->area = tcp_least_thread(tcp_->mgr);
-	tcp_->client->fd = socket(AF_INET, SOCK_STREAM, 0);
+	tcp_->client->family = tcp_->path[0] ? AF_UNIX : tcp_->addr.ss_family;
+	tcp_->client->fd = socket(tcp_->client->family, SOCK_STREAM, 0);
 	if(tcp_->client->fd < 0){
 		errno = ENOSOCK;
 		return -1;
@@ -930,42 +2251,69 @@ static int init_tcp_client(struct tcp * tcp_){
 		errno = EINVAL;
 		return -1;
 	}
-	if(tcp_set_keepalive(tcp_->client->fd) < 0){
+	if(tcp_set_options(tcp_, tcp_->client->fd, tcp_->client->family) < 0){
 		_close_socket(tcp_->client->fd);
 		errno = EINVAL;
 		return -1;
 	}
-	if(setsockopt(tcp_->client->fd, SOL_SOCKET, SO_SNDBUF, (char *)&size, sizeof(int)) < 0){
+	tcp_->client->cork = AF_UNIX != tcp_->client->family && get_plug_option(tcp_->plug, EMC_PLUG_CORK) > 0;
+	if(setsockopt(tcp_->client->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag)) < 0){
 		_close_socket(tcp_->client->fd);
 		errno = EINVAL;
 		return -1;
 	}
-	if(setsockopt(tcp_->client->fd, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(int)) < 0){
-		_close_socket(tcp_->client->fd);
-		errno = EINVAL;
-		return -1;
+#if !defined (EMC_WINDOWS)
+	if(get_device_busypoll(tcp_->mgr->device)){
+		tcp_set_busypoll(tcp_->client->fd, get_device_busypoll(tcp_->mgr->device));
 	}
-	if(setsockopt(tcp_->client->fd, SOL_SOCKET, SO_REUSEADDR, (char *)&flag, sizeof(flag)) < 0){
-		_close_socket(tcp_->client->fd);
-		errno = EINVAL;
-		return -1;
+#endif
+#if defined (TCP_ZEROCOPY)
+	tcp_set_zerocopy(tcp_, tcp_->client);
+#endif
+#if defined (TCP_FASTOPEN_CONNECT)
+	// Once the server has handed out a cookie,reconnects carry the login in the syn
+	if(AF_UNIX != tcp_->client->family){
+		setsockopt(tcp_->client->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, (char *)&flag, sizeof(flag));
+	}
+#endif
+	tcp_->client->port = tcp_->port;
+#if defined (TCP_UNIX)
+	// A unix connect completes or fails at once,EAGAIN is a full listen queue
+	if(AF_UNIX == tcp_->client->family){
+		salen = tcp_unix_addr(tcp_->path, &uaddr);
+		sa = (struct sockaddr *)&uaddr;
+		strncpy(tcp_->client->ip, "unix", ADDR_LEN);
+	}else
+#endif
+	{
+		tcp_addr_str(&tcp_->addr, tcp_->client->ip);
 	}
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = tcp_->ip;
-	addr.sin_port = htons(tcp_->port);
-	if(connect(tcp_->client->fd, (const struct sockaddr*)&addr, sizeof(struct sockaddr_in)) < 0){
+	if(connect(tcp_->client->fd, sa, salen) < 0){
 #if defined (EMC_WINDOWS)
 		if(WSAEWOULDBLOCK != GetLastError()){
 #else
 		if(errno != EINPROGRESS){
 #endif
 			_close_socket(tcp_->client->fd);
+			tcp_->client->fd = -1;
 			errno = EINVAL;
 			return -1;
 		}
+#if !defined (EMC_WINDOWS)
+		// The reactor finishes the connection,the reconnect thread enforces the deadline
+		tcp_->client->deadline = time_get_time() + TCP_CONNECT_TIMEOUT;
+		tcp_->client->state = TCP_STATE_CONNECTING;
+		if(tcp_add_event(tcp_->client->area, tcp_->client, EMC_WRITE) < 0){
+			tcp_->client->state = TCP_STATE_CLOSED;
+			_close_socket(tcp_->client->fd);
+			tcp_->client->fd = -1;
+			return -1;
+		}
+		return 0;
+#endif
 	}
-	while(1){
 #if defined (EMC_WINDOWS)
+	while(1){
 		FD_ZERO(&wdset);
 		FD_ZERO(&rdset);
 		FD_SET(tcp_->client->fd, &wdset);
@@ -999,48 +2347,51 @@ static int init_tcp_client(struct tcp * tcp_){
 				errno = EINVAL;
 				return -1;
 			}
-			tcp_->client->connected = 1;
 			break;
 		}
-#else
-		fds.fd = tcp_->client->fd;
-		fds.events |= POLLOUT;
-		if(poll(&fds, 1, 100) > 0){
-			if(fds.revents & POLLOUT){
-				if(getsockopt(tcp_->client->fd, SOL_SOCKET, SO_ERROR, (char*)&erro, &erro_len) < 0){
-					_close_socket(tcp_->client->fd);
-					errno = EINVAL;
-					return -1;
-				}
-				if(0 != erro){
-					_close_socket(tcp_->client->fd);
-					errno = EINVAL;
-					return -1;
-				}
-				tcp_->client->connected = 1;
-				break;
-			}
-		}
-#endif
 		selecttime --;
 		if(!selecttime){
-			tcp_->client->connected = 0;
 			_close_socket(tcp_->client->fd);
 			errno = ETIME;
 			return -1;
 		}
 	}
+#endif
+	// Connected,on linux only when connect returns at once,for loopback or fast open
 	if(tcp_add_event(tcp_->client->area, tcp_->client, EMC_READ) < 0){
 		_close_socket(tcp_->client->fd);
-		tcp_->client->connected = 0;
+		tcp_->client->fd = -1;
 		return -1;
 	}
-	strncpy(tcp_->client->ip, inet_ntoa(addr.sin_addr), ADDR_LEN);
-	tcp_->client->port = ntohs(addr.sin_port);
+	tcp_connect_done(tcp_);
 	return 0;
 }
 
 // Initialize tcp manager
+// Stop the threads of the areas and release what they own
+static void tcp_stop_areas(struct tcp_mgr * mgr){
+	uint index = 0;
+	mgr->exit = 1;
+	for(index = 0; index < mgr->count; index ++){
+#if defined (EMC_WINDOWS)
+		PostQueuedCompletionStatus(mgr->area[index].fd, 0xFFFFFFFF, 0, NULL);
+		CloseHandle(mgr->area[index].fd);
+#else
+		close(mgr->area[index].fd);
+#endif
+		emc_thread_join(mgr->area[index].twork);
+		emc_thread_join(mgr->area[index].tsend);
+#if !defined (EMC_WINDOWS)
+		if(mgr->area[index].reserve >= 0){
+			close(mgr->area[index].reserve);
+		}
+#endif
+		post_uqueue(mgr->area[index].wmq);
+		delete_uqueue(mgr->area[index].wmq);
+		mgr->area[index].wmq = NULL;
+	}
+}
+
 static int init_tcp_mgr(struct tcp_mgr * mgr, int thread){
 	int index = 0;
 
@@ -1053,15 +2404,28 @@ static int init_tcp_mgr(struct tcp_mgr * mgr, int thread){
 		return -1;
 	}
 	memset(mgr->area, 0, sizeof(struct tcp_area) * thread);
+	mgr->count = thread;
 	for(index = 0; index < thread; index ++){
-		mgr->area[index].wmq = create_uqueue();
-#if defined (EMC_WINDOWS)
-		mgr->area[index].fd  = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
-#else
-		mgr->area[index].fd  = epoll_create(EMC_SOCKETS_DEFAULT);
-#endif
 		mgr->area[index].mgr = mgr;
+		mgr->area[index].sample = time_get_time();
+		emc_queue_init(&mgr->area[index].clients);
+		mgr->area[index].budget = get_device_busypoll(mgr->device);
+		mgr->area[index].cpu = get_mask_cpu(get_device_affinity(mgr->device), index);
 		mgr->area[index].twork = emc_thread(tcp_work_cb, mgr->area + index);
+		// The work thread creates the poll and the queue of the area
+		while(!mgr->area[index].ready){
+			nsleep(1);
+		}
+		if(!mgr->area[index].wmq){
+			emc_thread_join(mgr->area[index].twork);
+			// The areas started before are stopped again
+			mgr->count = index;
+			tcp_stop_areas(mgr);
+			free(mgr->area);
+			mgr->area = NULL;
+			errno = ENOMEM;
+			return -1;
+		}
 		mgr->area[index].tsend = emc_thread(tcp_send_cb, mgr->area + index);
 	}
 	return 0;
@@ -1082,15 +2446,29 @@ struct tcp_mgr * create_tcp_mgr(int device, int thread){
 	return mgr;
 }
 
-struct tcp * add_tcp(uint ip, ushort port, ushort mode, int type, int plug, struct tcp_mgr * mgr){
-	struct tcp * tcp_ = (struct tcp *)malloc(sizeof(struct tcp));
+struct tcp * add_tcp(const char * ip, ushort port, const char * path, ushort mode, int type, int plug, struct tcp_mgr * mgr){
+	struct tcp * tcp_ = NULL;
+#if !defined (TCP_UNIX)
+	if(path){
+		errno = EINVAL;
+		return NULL;
+	}
+#endif
+	tcp_ = (struct tcp *)malloc(sizeof(struct tcp));
 	if(!tcp_) {
 		errno = ENOMEM;
 		return NULL;
 	}
 	memset(tcp_, 0, sizeof(struct tcp));
-	tcp_->ip = ip;
 	tcp_->port = port;
+	if(path){
+		strncpy(tcp_->path, path, PATH_LEN - 1);
+	}
+	// A bound plug listens on the port beside the unix socket
+	if((!path || (EMC_LOCAL == type && port)) && tcp_resolve(tcp_, ip) < 0){
+		free(tcp_);
+		return NULL;
+	}
 	tcp_->type = type;
 	tcp_->mgr = mgr;
 	tcp_->plug = plug;
@@ -1121,10 +2499,16 @@ struct tcp * add_tcp(uint ip, ushort port, ushort mode, int type, int plug, stru
 			return NULL;
 		}
 		memset(tcp_->client, 0, sizeof(struct tcp_client));
+		emc_queue_init(&tcp_->client->zcq);
 		tcp_->client->id = -1;
 		tcp_->client->mode = mode;
 		tcp_->client->tcp_ = tcp_;
 		if(init_tcp_client(tcp_) < 0){
+			tcp_backoff(tcp_->client);
+		}
+		// A connection in progress or failed is carried on by the reconnect thread,
+		// the login packet is sent once it is up
+		if(TCP_STATE_OPEN > tcp_->client->state){
 			if(global_add_reconnect(tcp_->client->id, tcp_reconnect_cb, tcp_->client, tcp_) < 0){
 				_close_socket(tcp_->client->fd);
 				global_idle_connect_id(tcp_->client->id);
@@ -1135,44 +2519,46 @@ struct tcp * add_tcp(uint ip, ushort port, ushort mode, int type, int plug, stru
 				return NULL;
 			}
 		}
-		// Log packet sent to the server
-		tcp_send_login(tcp_);
 	}
 	return tcp_;
 }
 
 void delete_tcp_mgr(struct tcp_mgr * mgr){
-	uint index = 0;
-	mgr->exit = 1;
-	for(index = 0; index < get_device_thread(mgr->device); index ++){
-#if defined (EMC_WINDOWS)
-		PostQueuedCompletionStatus(mgr->area[index].fd, 0xFFFFFFFF, 0, NULL);
-		CloseHandle(mgr->area[index].fd);
-#else
-		close(mgr->area[index].fd);
-#endif
-		emc_thread_join(mgr->area[index].twork);
-		emc_thread_join(mgr->area[index].tsend);
-		post_uqueue(mgr->area[index].wmq);
-		delete_uqueue(mgr->area[index].wmq);
-		mgr->area[index].wmq = NULL;
-	}
+	tcp_stop_areas(mgr);
 	free(mgr);
 }
 
 void delete_tcp(struct tcp * tcp_){
 	if(tcp_){
-		tcp_->flag = EMC_DEAD;
 		tcp_->exit = 1;
+		if(EMC_REMOTE == tcp_->type){
+			// Closed while the plug is live still,process_close leaves a dead one alone
+			// and the socket would stay in the poll of its area
+			global_free_reconnect(tcp_->client->id);
+			process_close(tcp_, tcp_->client->area, tcp_->client->id);
+		}
+		tcp_->flag = EMC_DEAD;
 		if(EMC_LOCAL == tcp_->type){
-			_close_socket(tcp_->server->fd);
+			tcp_close_listener(tcp_);
+#if defined (EMC_WINDOWS)
 			emc_thread_join(tcp_->server->taccept);
+#else
+			if(tcp_->path[0] && '@' != tcp_->path[0]){
+				unlink(tcp_->path);
+			}
+#endif
 			hashmap_foreach(tcp_->server->connection, tcp_close_cb, NULL);
+#if !defined (EMC_WINDOWS)
+			// Nor may a batch hold one of the connections closed just now
+			tcp_quiesce(tcp_->mgr);
+#endif
+			tcp_free_listener(tcp_);
 			hashmap_delete(tcp_->server->connection);
 			free(tcp_->server);
 		}else if(EMC_REMOTE == tcp_->type){
-			global_free_reconnect(tcp_->client->id);
-			process_close(tcp_, tcp_->client->area, tcp_->client->id);
+#if !defined (EMC_WINDOWS)
+			tcp_quiesce(tcp_->mgr);
+#endif
 			free(tcp_->client);
 			tcp_->client = NULL;
 		}
@@ -1217,7 +2603,7 @@ int send_tcp(struct tcp * tcp_, void * msg, int flag){
 	case EMC_SUB:
 		if(EMC_REMOTE == tcp_->type){
 			emc_msg_setid(msg, tcp_->client->id);
-			if(!tcp_->client->connected || !tcp_->client->completed){
+			if(TCP_STATE_OPEN > tcp_->client->state){
 				tcp_post_monitor(tcp_, tcp_->client, EMC_EVENT_SNDFAIL, msg);
 				errno = ENOLIVE;
 				return -1;
@@ -1229,7 +2615,7 @@ int send_tcp(struct tcp * tcp_, void * msg, int flag){
 		}else{
 			client = tcp_->client;
 		}
-		if(!client || !client->connected || !client->completed){
+		if(!client || TCP_STATE_OPEN > client->state){
 			errno = ENOLIVE;
 			return -1;
 		}
@@ -1255,12 +2641,12 @@ int send_tcp(struct tcp * tcp_, void * msg, int flag){
 				errno = EQUEUE;
 				return -1;
 			}
-			while(client->connected && 0 == emc_msg_zero_ref(msg)){}
+			while(TCP_STATE_OPEN <= client->state && 0 == emc_msg_zero_ref(msg)){}
 			if(emc_msg_get_result(msg, &result) < 0){
 				return -1;
 			}
 			if(result) return 0;
-			if(!client->connected) {
+			if(TCP_STATE_OPEN > client->state) {
 				errno = ENOLIVE;
 				return -1;
 			}
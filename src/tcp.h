@@ -37,7 +37,7 @@ struct tcp_mgr;
 struct tcp;
 
 struct tcp_mgr * create_tcp_mgr(int device, int thread);
-struct tcp * add_tcp(unsigned int ip, unsigned short port, unsigned short mode, int type, int plug, struct tcp_mgr * mgr);
+struct tcp * add_tcp(const char * ip, unsigned short port, const char * path, unsigned short mode, int type, int plug, struct tcp_mgr * mgr);
 void delete_tcp_mgr(struct tcp_mgr * mgr);
 void delete_tcp(struct tcp *);
 int close_tcp(struct tcp *,int);
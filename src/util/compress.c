@@ -0,0 +1,205 @@
+/* Copyright (c) 2014, mashka <easymc2014@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of easymc nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "../config.h"
+#include "../emc.h"
+#include "compress.h"
+
+// Hash table size of the lz codec
+#define LZ_HASH_LOG			12
+#define LZ_HASH_SIZE		(1 << LZ_HASH_LOG)
+// Longest literal run,farthest and longest back reference
+#define LZ_MAX_LITERAL		32
+#define LZ_MAX_OFFSET		8192
+#define LZ_MAX_MATCH		(7 + 255 + 2)
+
+struct codec{
+	emc_codec_cb		*compress;
+	emc_codec_cb		*decompress;
+};
+
+static int lz_compress(const char * src, int len, char * dst, int cap);
+static int lz_decompress(const char * src, int len, char * dst, int cap);
+
+static struct codec lz = {lz_compress, lz_decompress};
+// Entries filled by emc_codec,each id once
+static struct codec registered[COMPRESS_CODECS];
+static volatile uint claimed[COMPRESS_CODECS];
+// Codecs in use,an entry is complete before its pointer is published
+// so a reactor thread never sees half of a registration
+static struct codec * volatile codecs[COMPRESS_CODECS] = {NULL, &lz};
+
+static uint compress_number_cas(volatile uint * key, uint _old, uint _new){
+#ifdef EMC_WINDOWS
+	return InterlockedCompareExchange((long *)key, _new, _old);
+#else
+	return __sync_val_compare_and_swap(key, _old, _new);
+#endif
+}
+
+static struct codec * compress_get(int codec){
+	if(codec <= 0 || codec >= COMPRESS_CODECS) return NULL;
+	return codecs[codec];
+}
+
+// Lzf style codec,a control byte below 32 starts a literal run of that many bytes plus 1,
+// otherwise the top 3 bits are the match length minus 2 (7 takes one more byte)
+// and the low 5 bits with the next byte the distance minus 1
+static int lz_compress(const char * src, int len, char * dst, int cap){
+	const uchar * ip = (const uchar *)src, * end = ip + len, * ref = NULL;
+	uchar * op = (uchar *)dst, * oend = op + cap;
+	int htab[LZ_HASH_SIZE];
+	uint hval = 0, off = 0, mlen = 0, maxlen = 0, lit = 0;
+
+	if(len <= 0 || cap < 2) return 0;
+	memset(htab, 0, sizeof(htab));
+	// Room for the control byte of the first literal run
+	op ++;
+	while(ip + 2 < end){
+		hval = ((ip[0] << 16) | (ip[1] << 8) | ip[2]) * 2654435761u >> (32 - LZ_HASH_LOG);
+		ref = htab[hval] ? (const uchar *)src + htab[hval] - 1 : NULL;
+		htab[hval] = (int)(ip - (const uchar *)src) + 1;
+		if(ref && (off = (uint)(ip - ref - 1)) < LZ_MAX_OFFSET &&
+			ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]){
+			maxlen = (uint)(end - ip);
+			if(maxlen > LZ_MAX_MATCH) maxlen = LZ_MAX_MATCH;
+			mlen = 3;
+			while(mlen < maxlen && ref[mlen] == ip[mlen]){
+				mlen ++;
+			}
+			// Close the literal run,or take back its unused control byte
+			if(lit){
+				op[- (int)lit - 1] = (uchar)(lit - 1);
+			}else{
+				op --;
+			}
+			if(op + 4 > oend) return 0;
+			mlen -= 2;
+			if(mlen < 7){
+				*op ++ = (uchar)((off >> 8) + (mlen << 5));
+			}else{
+				*op ++ = (uchar)((off >> 8) + (7 << 5));
+				*op ++ = (uchar)(mlen - 7);
+			}
+			*op ++ = (uchar)off;
+			ip += mlen + 2;
+			lit = 0;
+			op ++;
+			continue;
+		}
+		if(op >= oend) return 0;
+		*op ++ = *ip ++;
+		if(++ lit == LZ_MAX_LITERAL){
+			op[- (int)lit - 1] = (uchar)(lit - 1);
+			lit = 0;
+			op ++;
+		}
+	}
+	while(ip < end){
+		if(op >= oend) return 0;
+		*op ++ = *ip ++;
+		if(++ lit == LZ_MAX_LITERAL){
+			op[- (int)lit - 1] = (uchar)(lit - 1);
+			lit = 0;
+			op ++;
+		}
+	}
+	if(lit){
+		op[- (int)lit - 1] = (uchar)(lit - 1);
+	}else{
+		op --;
+	}
+	if(op > oend) return 0;
+	return (int)(op - (uchar *)dst);
+}
+
+static int lz_decompress(const char * src, int len, char * dst, int cap){
+	const uchar * ip = (const uchar *)src, * end = ip + len;
+	uchar * op = (uchar *)dst, * oend = op + cap, * ref = NULL;
+	uint ctrl = 0, mlen = 0;
+
+	while(ip < end){
+		ctrl = *ip ++;
+		if(ctrl < LZ_MAX_LITERAL){
+			ctrl ++;
+			if(ip + ctrl > end || op + ctrl > oend) return 0;
+			memcpy(op, ip, ctrl);
+			ip += ctrl;
+			op += ctrl;
+			continue;
+		}
+		mlen = ctrl >> 5;
+		if(7 == mlen){
+			if(ip >= end) return 0;
+			mlen += *ip ++;
+		}
+		if(ip >= end) return 0;
+		ref = op - ((ctrl & 0x1f) << 8) - *ip ++ - 1;
+		mlen += 2;
+		if(ref < (uchar *)dst || op + mlen > oend) return 0;
+		// The reference may overlap the output,copy byte by byte
+		while(mlen --){
+			*op ++ = *ref ++;
+		}
+	}
+	return (int)(op - (uchar *)dst);
+}
+
+unsigned int compress_has(int codec){
+	return NULL != compress_get(codec);
+}
+
+int compress_data(int codec, const char * src, int len, char * dst, int cap){
+	struct codec * c = compress_get(codec);
+	if(!c) return 0;
+	return c->compress(src, len, dst, cap);
+}
+
+int decompress_data(int codec, const char * src, int len, char * dst, int cap){
+	struct codec * c = compress_get(codec);
+	if(!c) return 0;
+	return c->decompress(src, len, dst, cap);
+}
+
+// Meant to be called before the devices using the codec are created,
+// an id registered later is published whole and cannot be replaced
+int emc_codec(int id, emc_codec_cb * compress, emc_codec_cb * decompress){
+	if(id <= EMC_CODEC_LZ || id >= COMPRESS_CODECS || !compress || !decompress){
+		errno = EINVAL;
+		return -1;
+	}
+	if(0 != compress_number_cas(&claimed[id], 0, 1)){
+		errno = EREBIND;
+		return -1;
+	}
+	registered[id].decompress = decompress;
+	registered[id].compress = compress;
+	emc_mb();
+	codecs[id] = registered + id;
+	return 0;
+}
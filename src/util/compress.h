@@ -26,38 +26,26 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifndef __EMC_RINGARRAY_H_INCLUDE__
-#define __EMC_RINGARRAY_H_INCLUDE__
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+/**********************************************************************
+  Compression codecs of the frame payloads,id 1 is the built-in lz codec
+**********************************************************************/
 
 #ifdef __cplusplus
 extern "C"{
 #endif
 
-	struct ringarray;
-
-	void init_ringarray(struct ringarray *);
-
-	/**************************************************************************
-	* Name: push_ringarray
-	* Function: Writes a value to ringarray inside
-	* Input: struct ringarray pointer,value
-	* Output: N/A
-	* Return: 0 Success-1 Failure
-	* Remark: N/A
-	***************************************************************************/
-	int push_ringarray(struct ringarray *,int);
-
-	/**************************************************************************
-	* Name: pop_ringarray
-	* Function: Pop-up data from the ringarray
-	* Input: struct ringarray pointer,Incoming buffer address from the outside
-	* Output: N/A
-	* Return: 0 Success-1 Failure
-	* Remark: N/A
-	***************************************************************************/
-	int pop_ringarray(struct ringarray *,void *);
+// Number of codec ids
+#define COMPRESS_CODECS		16
 
-	int get_ringarray_size();
+// Whether the codec is registered
+unsigned int compress_has(int codec);
+// Compress into dst,returns the output length,0 when it does not fit in cap
+int compress_data(int codec, const char * src, int len, char * dst, int cap);
+// Decompress into dst,returns the output length,0 on corrupt data or when it does not fit in cap
+int decompress_data(int codec, const char * src, int len, char * dst, int cap);
 
 #ifdef __cplusplus
 }
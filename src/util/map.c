@@ -29,6 +29,7 @@
 #include "../emc.h"
 #include "../config.h"
 #include "lock.h"
+#include "thread.h"
 #include "map.h"
 
 #pragma pack(1)
@@ -39,13 +40,18 @@ struct map_node{
 
 struct map{
 	struct map_node	*	node;
+	// Thread in map_foreach,only its callbacks use the map without the lock
+	volatile uint64		owner;
 	volatile uint		size;
 	volatile uint		used;
 	volatile uint		lock;
-	volatile uint		foreach;
 };
 #pragma pack()
 
+static emc_inline uint64 map_self(void){
+	return (uint64)thread_self();
+}
+
 static int map_sort_swap(struct map * m, int64 key, void * val){
 	int low = 0, mid = 0, high = m->used - 1;
 
@@ -125,7 +131,7 @@ int map_add(struct map * m, int64 key, void * val){
 int map_get(struct map * m, int64 key, void ** val){
 	int n = -1, locked = 0;
 	if(val) *val = NULL;
-	if(!m->foreach){
+	if(m->owner != map_self()){
 		emc_lock(&m->lock);
 		locked = 1;
 	}
@@ -152,7 +158,7 @@ int map_get(struct map * m, int64 key, void ** val){
 int map_set(struct map * m, int64 key, void * val){
 	int n = -1, locked = 0;
 
-	if(!m->foreach){
+	if(m->owner != map_self()){
 		emc_lock(&m->lock);
 		locked = 1;
 	}
@@ -180,7 +186,7 @@ int	map_erase(struct map * m, int64 key){
 	int n = -1, locked = 0;
 	struct map_node * _node = NULL;
 
-	if(!m->foreach){
+	if(m->owner != map_self()){
 		emc_lock(&m->lock);
 		locked = 1;
 	}
@@ -215,7 +221,7 @@ void map_foreach(struct map * m, map_foreach_cb * cb, void * addition){
 	int index = 0;
 
 	emc_lock(&m->lock);
-	emc_lock(&m->foreach);
+	m->owner = map_self();
 	for(index = 0; index < m->used; index ++){
 		if(cb){
 			if(cb(m, m->node[index].key, m->node[index].p, addition)){
@@ -223,13 +229,13 @@ void map_foreach(struct map * m, map_foreach_cb * cb, void * addition){
 			}
 		}
 	}
-	emc_unlock(&m->foreach);
+	m->owner = 0;
 	emc_unlock(&m->lock);
 }
 
 uint map_size(struct map * m){
 	uint size = 0, locked = 0;
-	if(!m->foreach){
+	if(m->owner != map_self()){
 		emc_lock(&m->lock);
 		locked = 1;
 	}
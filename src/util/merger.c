@@ -136,7 +136,8 @@ int merger_get(void * block, merger_get_cb * cb, int id, void * addition){
 
 	if(unit->data && unit->total == unit->len){
 		if(cb){
-			cb(unit->data, unit->total, id, addition);
+			// The data follows the received flags of the packets
+			cb(unit->data + unit->packets * sizeof(int), unit->total, id, addition);
 		}
 		free(unit->data);
 		unit->data = NULL;
@@ -30,115 +30,226 @@
 #include "../emc.h"
 #include "ringbuffer.h"
 
-#define _RB_SIZE	(0x80)
-#define _RB_MASK	(0x7F)
-
-#pragma pack(1)
+// Record head,the length and the producer keeping the bodies 8 bytes aligned
+#define _RB_HEAD	(sizeof(struct ringbuffer_head))
+#define _RB_ALIGN(x)	(((x) + 7) & ~7)
+// Length of the pad left at the end of a lap
+#define _RB_PAD		(0xFFFFFFFF)
+
+struct ringbuffer_head{
+	uint			len;
+	// Process that reserved the record,0 once given up for a producer that is gone
+	volatile uint	owner;
+};
 
 struct ringbuffer{
-	volatile int	cursor;
-	volatile int	pd;
-	volatile int	real;
-	volatile int	cs;
+	// Records before it are committed and readable
+	volatile int64	cursor;
+	// Records before it are reserved by the producers
+	volatile int64	pd;
+	// Records before it are released by the consumer
+	volatile int64	real;
+	// Bytes of the record area following the header
+	uint			size;
+	// Process reserving,the heads are written before pd moves past them
+	volatile uint	lck;
 };
 
-#pragma pack()
-
-static void put_ordered_char(volatile char * buffer, uint offset, char flag){
-	volatile char * addr = buffer+offset;
-	*addr = flag;
-}
-
-static int get_int_volatitle(volatile int * buffer, uint offset){
-	volatile int * addr = buffer + offset;
-	int result = *addr;
+static int64 get_int64_volatitle(volatile int64 * addr){
+	int64 result = *addr;
 	emc_mb();
 	return result;
 }
 
-static uint ringbuffer_number_cas(volatile int * key, uint _old, uint _new){
+static int64 ringbuffer_number_cas(volatile int64 * key, int64 _old, int64 _new){
 #ifdef EMC_WINDOWS
-	return InterlockedCompareExchange((long*)key, _new, _old);
+	return InterlockedCompareExchange64((LONGLONG *)key, _new, _old);
 #else
 	return __sync_val_compare_and_swap(key, _old, _new);
 #endif
 }
 
-static uint ringbuffer_write_next(struct ringbuffer * rb){
-	uint current = 0, next = 0;
-	do{
-		current = get_int_volatitle(&rb->pd, 0);
-		next = current + 1;
-	}while(current != ringbuffer_number_cas(&rb->pd, current, next));
-	return next;
+static uint ringbuffer_lock_cas(volatile uint * key, uint _old, uint _new){
+#ifdef EMC_WINDOWS
+	return InterlockedCompareExchange((long *)key, _new, _old);
+#else
+	return __sync_val_compare_and_swap(key, _old, _new);
+#endif
 }
 
-static int ringbuffer_read_next(struct ringbuffer * rb, int * cursor){
-	int current = 0, next = 0;
-	do{
-		current = get_int_volatitle(&rb->cs, 0);
-		next = current + 1;
-		if(next > get_int_volatitle(&rb->cursor, 0)){
-			return -1;
-		}
-	}while(current != ringbuffer_number_cas(&rb->cs, current, next));
-	*cursor = next;
-	return 0;
+// Process writing the records,kept once taken
+static uint ringbuffer_owner(void){
+	static uint owner = 0;
+	if(!owner){
+#if defined (EMC_WINDOWS)
+		owner = (uint)GetCurrentProcessId();
+#else
+		owner = (uint)getpid();
+#endif
+	}
+	return owner;
+}
+
+static char * ringbuffer_area(struct ringbuffer * rb, int64 position){
+	return (char *)rb + sizeof(struct ringbuffer) + (uint)(position % rb->size);
 }
 
-static uint ringbuffer_check_consumer(struct ringbuffer * rb){
-	if(get_int_volatitle(&rb->pd, 0) - get_int_volatitle(&rb->real, 0) + 1 >= _RB_SIZE){
-		return 1;
+// Head of the record reserved at position,behind the pad when the record starts the next lap
+static struct ringbuffer_head * ringbuffer_head(struct ringbuffer * rb, int64 position, int64 * end){
+	struct ringbuffer_head * head = (struct ringbuffer_head *)ringbuffer_area(rb, position);
+	if(_RB_PAD == head->len){
+		position += rb->size - (uint)(position % rb->size);
+		head = (struct ringbuffer_head *)ringbuffer_area(rb, position);
 	}
-	return 0;
+	*end = position + _RB_ALIGN(_RB_HEAD + head->len);
+	return head;
 }
 
-void init_ringbuffer(struct ringbuffer * rb){
-	rb->cursor = -1;
-	rb->cs = -1;
-	rb->pd = -1;
-	rb->real = -1;
+// Move the commit cursor from position over the records given up.
+// The producer committing before them or the repair giving them up passes them,whichever comes last
+static void ringbuffer_pass(struct ringbuffer * rb, int64 position){
+	int64 end = 0;
+	emc_mb();
+	while(position < get_int64_volatitle(&rb->pd)){
+		if(ringbuffer_head(rb, position, &end)->owner) break;
+		if(position != ringbuffer_number_cas(&rb->cursor, position, end)) break;
+		position = end;
+	}
 }
 
-int push_ringbuffer(struct ringbuffer * rb, void * data, uint len){
-	uint current = 0, cursor = 0, index = 0;
+uint get_ringbuffer_size(uint capacity){
+	return sizeof(struct ringbuffer) + _RB_ALIGN(capacity);
+}
 
-	if(len > MAX_DATA_SIZE || ringbuffer_check_consumer(rb) > 0) return -1;
-	cursor = ringbuffer_write_next(rb);
-	memcpy((char *)rb + sizeof(struct ringbuffer) + MAX_DATA_SIZE * (cursor & _RB_MASK), data, len);
-	//commit
-	do{
-		current = get_int_volatitle(&rb->cursor, 0);
-		if(current + 1 == cursor){
-			if(current == ringbuffer_number_cas(&rb->cursor, current, cursor)){
-				break;
-			}
-		}
-	}while(1);
-	return 0;
+uint get_ringbuffer_record(uint capacity){
+	// With half of the area free a record fits either before the end or after the pad
+	return _RB_ALIGN(capacity) / 2 - _RB_HEAD;
 }
 
-int pop_ringbuffer(struct ringbuffer * rb, void * buffer){
-	uint current = 0;
-	int cursor = 0;
+void init_ringbuffer(struct ringbuffer * rb, uint capacity){
+	rb->cursor = 0;
+	rb->pd = 0;
+	rb->real = 0;
+	rb->size = _RB_ALIGN(capacity);
+	rb->lck = 0;
+}
 
-	if(get_int_volatitle(&rb->cursor, 0) - get_int_volatitle(&rb->cs, 0) <= 0){
+uint get_ringbuffer_free(struct ringbuffer * rb){
+	return rb->size - (uint)(get_int64_volatitle(&rb->pd) - get_int64_volatitle(&rb->real));
+}
+
+int push_ringbuffer(struct ringbuffer * rb, void * head, uint hlen, void * data, uint len){
+	int64 current = 0, next = 0;
+	uint need = _RB_ALIGN(_RB_HEAD + hlen + len), offset = 0, gap = 0, owner = ringbuffer_owner();
+	struct ringbuffer_head * record = NULL;
+
+	if(hlen + len > get_ringbuffer_record(rb->size)) return -1;
+	// Reserve,the heads naming this process are in place before the record is published
+	// so a record whose producer is gone can be given up by repair_ringbuffer
+	while(rb->lck || 0 != ringbuffer_lock_cas(&rb->lck, 0, owner));
+	current = rb->pd;
+	offset = (uint)(current % rb->size);
+	gap = rb->size - offset < need ? rb->size - offset : 0;
+	next = current + gap + need;
+	if(next - get_int64_volatitle(&rb->real) > rb->size){
+		ringbuffer_lock_cas(&rb->lck, owner, 0);
 		return -1;
 	}
-	if(ringbuffer_read_next(rb, &cursor) < 0){
-		return -1;
+	if(gap){
+		record = (struct ringbuffer_head *)ringbuffer_area(rb, current);
+		record->len = _RB_PAD;
+		record->owner = owner;
 	}
-	if(buffer){
-		memcpy(buffer, (char *)rb + sizeof(struct ringbuffer) + (cursor & _RB_MASK) * MAX_DATA_SIZE, MAX_DATA_SIZE);
+	record = (struct ringbuffer_head *)ringbuffer_area(rb, current + gap);
+	record->len = hlen + len;
+	record->owner = owner;
+	emc_mb();
+	rb->pd = next;
+	ringbuffer_lock_cas(&rb->lck, owner, 0);
+	if(head && hlen){
+		memcpy((char *)record + _RB_HEAD, head, hlen);
 	}
-	//commit
-	do{
-		current = get_int_volatitle(&rb->real, 0);
-		if(current + 1 == cursor){
-			if(current == ringbuffer_number_cas(&rb->real, current, cursor)){
-				break;
-			}
-		}
-	}while(1);
+	if(data && len){
+		memcpy((char *)record + _RB_HEAD + hlen, data, len);
+	}
+	//commit,after the producers that reserved before
+	do{}while(current != ringbuffer_number_cas(&rb->cursor, current, next));
+	// Records given up right behind are passed too
+	ringbuffer_pass(rb, next);
 	return 0;
 }
+
+int peek_ringbuffer(struct ringbuffer * rb, void ** data){
+	int64 real = rb->real;
+	uint len = 0;
+
+	struct ringbuffer_head * head = NULL;
+
+	while(real < get_int64_volatitle(&rb->cursor)){
+		head = (struct ringbuffer_head *)ringbuffer_area(rb, real);
+		len = head->len;
+		if(_RB_PAD == len){
+			// Skip to the next lap
+			real += rb->size - (uint)(real % rb->size);
+		}else if(head->owner){
+			*data = (char *)head + _RB_HEAD;
+			return (int)len;
+		}else{
+			// Given up,its producer is gone
+			real += _RB_ALIGN(_RB_HEAD + len);
+		}
+		rb->real = real;
+	}
+	return -1;
+}
+
+void pop_ringbuffer(struct ringbuffer * rb){
+	int64 real = rb->real;
+	uint len = *(uint *)ringbuffer_area(rb, real);
+	// The record has been read before the producers may reuse it
+	emc_mb();
+	rb->real = real + _RB_ALIGN(_RB_HEAD + len);
+}
+
+uint get_ringbuffer_pending(struct ringbuffer * rb, int64 * position){
+	int64 end = 0, cursor = get_int64_volatitle(&rb->cursor);
+	uint owner = 0;
+
+	if(cursor >= get_int64_volatitle(&rb->pd)) return 0;
+	owner = ringbuffer_head(rb, cursor, &end)->owner;
+	emc_mb();
+	// Committed and released meanwhile,the head read may already be reused
+	if(cursor != get_int64_volatitle(&rb->cursor)) return 0;
+	*position = cursor;
+	return owner;
+}
+
+int repair_ringbuffer(struct ringbuffer * rb, uint owner){
+	struct ringbuffer_head * head = NULL;
+	int64 position = 0, end = 0, pd = 0;
+	int count = 0;
+
+	if(!owner) return 0;
+	// Gone while reserving,the lock is left behind
+	ringbuffer_lock_cas(&rb->lck, owner, 0);
+	pd = get_int64_volatitle(&rb->pd);
+	position = get_int64_volatitle(&rb->cursor);
+	// Every reservation before pd has its head,a record committed is passed by the cursor
+	while(position < pd){
+		head = ringbuffer_head(rb, position, &end);
+		emc_mb();
+		// Released while read,the heads may be reused,walk again from the cursor
+		if(get_int64_volatitle(&rb->real) > position){
+			position = get_int64_volatitle(&rb->cursor);
+			continue;
+		}
+		// A record of the producer gone is never committed,the cursor cannot pass it meanwhile
+		if(owner == head->owner){
+			head->owner = 0;
+			count ++;
+		}
+		position = end;
+	}
+	ringbuffer_pass(rb, get_int64_volatitle(&rb->cursor));
+	return count;
+}
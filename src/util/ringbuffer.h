@@ -35,27 +35,66 @@ extern "C"{
 
 	struct ringbuffer;
 
-	void init_ringbuffer(struct ringbuffer *);
+	// A byte ring of length prefixed records,any number of producers and one consumer.
+	// Records are stored whole,a record that would cross the end starts the next lap
+	// and leaves a pad behind
+
+	// Bytes taken by a ringbuffer holding capacity bytes of records
+	uint get_ringbuffer_size(uint capacity);
+
+	// The longest record a ringbuffer of the capacity always has room for
+	uint get_ringbuffer_record(uint capacity);
+
+	void init_ringbuffer(struct ringbuffer *, uint capacity);
+
+	// Bytes the producers may still reserve,a record crossing the end of a lap takes the rest of it too
+	uint get_ringbuffer_free(struct ringbuffer *);
 
 	/**************************************************************************
 	* Name: push_ringbuffer
-	* Function: Writes a value to ringbuffer inside
-	* Input: struct ringbuffer pointer,data pointer,data length
+	* Function: Writes a record made of a head and a body to ringbuffer inside
+	* Input: struct ringbuffer pointer,head pointer,head length,data pointer,data length
 	* Output: N/A
-	* Return: 0 Success-1 Failure
-	* Remark: N/A
+	* Return: 0 Success-1 Failure,full or the record is too long
+	* Remark: Records become readable in the order they were reserved,the record of
+	*         a producer gone before committing holds the rest back until repair_ringbuffer
 	***************************************************************************/
-	int push_ringbuffer(struct ringbuffer *,void *,uint);
+	int push_ringbuffer(struct ringbuffer *,void *,uint,void *,uint);
+
+	/**************************************************************************
+	* Name: peek_ringbuffer
+	* Function: Get the next record in place
+	* Input: struct ringbuffer pointer,address receiving the record pointer
+	* Output: N/A
+	* Return: Record length-1 Empty
+	* Remark: The record stays valid until pop_ringbuffer,consumer only
+	***************************************************************************/
+	int peek_ringbuffer(struct ringbuffer *,void **);
 
 	/**************************************************************************
 	* Name: pop_ringbuffer
-	* Function: Pop-up data from the ringbuffer
-	* Input: struct ringbuffer pointer,Incoming buffer address from the outside
+	* Function: Release the record returned by peek_ringbuffer
+	* Input: struct ringbuffer pointer
+	* Output: N/A
+	* Return: N/A
+	* Remark: consumer only
+	***************************************************************************/
+	void pop_ringbuffer(struct ringbuffer *);
+
+	// The process of the oldest record reserved and not committed yet,0 when none.
+	// position receives where the record starts
+	uint get_ringbuffer_pending(struct ringbuffer *, int64 * position);
+
+	/**************************************************************************
+	* Name: repair_ringbuffer
+	* Function: Give up the records a producer that is gone reserved and never committed
+	* Input: struct ringbuffer pointer,process of the producer
 	* Output: N/A
-	* Return: 0 Success-1 Failure
-	* Remark: N/A
+	* Return: Records given up
+	* Remark: Only for a process known to be gone,the consumer skips the records given up
+	*         and the producers waiting behind them commit. One caller at a time
 	***************************************************************************/
-	int pop_ringbuffer(struct ringbuffer *,void *);
+	int repair_ringbuffer(struct ringbuffer *, uint owner);
 
 #ifdef __cplusplus
 }
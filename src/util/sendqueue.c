@@ -160,3 +160,12 @@ int sendqueue_pop(struct sendqueue * sq, int id, void ** data){
 	emc_unlock(&sq->lock);
 	return 0;
 }
+
+int sendqueue_empty(struct sendqueue * sq, int id){
+	int empty = 1;
+	if(id < 0 || id >= EMC_SOCKETS_DEFAULT) return 1;
+	emc_lock(&sq->lock);
+	empty = emc_queue_empty(&sq->ids[id]);
+	emc_unlock(&sq->lock);
+	return empty;
+}
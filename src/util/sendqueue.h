@@ -40,6 +40,7 @@ extern "C"{
 	int sendqueue_push(struct sendqueue * sq, int id, void * data);
 	int sendqueue_push_head(struct sendqueue * sq, int id, void * data);
 	int sendqueue_pop(struct sendqueue * sq, int id, void ** data);
+	int sendqueue_empty(struct sendqueue * sq, int id);
 
 #ifdef __cplusplus
 }
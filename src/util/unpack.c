@@ -99,17 +99,63 @@ int unpack_add(void* block, char * data, int len){
 	return (unit->len + len) > UNPACK_BUFFER_SIZE?(UNPACK_BUFFER_SIZE - unit->len):len;
 }
 
+// Compact frame,a varint of the payload length shifted left by one 
+// with the compressed flag in the lowest bit,then the bare payload.
+// Only single frame data is compact and the varint is never longer than needed,
+// a logo followed by anything else is not taken as a frame
+static ushort unpack_get_compact(struct unpack_unit * unit, char * rpos, char * buffer){
+	uint value = 0, shift = 0, head = sizeof(ushort);
+	ushort length = 0;
+	uchar last = 0;
+
+	while(1){
+		if(unit->len <= head){
+			if(rpos > unit->buffer){
+				memmove(unit->buffer, rpos, unit->len);
+			}
+			return 0;
+		}
+		last = *(uchar *)(rpos + head ++);
+		value |= (uint)(last & 0x7f) << shift;
+		if(!(last & 0x80)) break;
+		shift += 7;
+		if(shift > 14) break;
+	}
+	length = (ushort)(value >> 1);
+	if(shift > 14 || (shift && !last) || length > TCP_DATA_SIZE){
+		memmove(unit->buffer, rpos + sizeof(ushort), unit->len - sizeof(ushort));
+		unit->len -= sizeof(ushort);
+		return 0;
+	}
+	if(unit->len < head + length){
+		if(rpos > unit->buffer){
+			memmove(unit->buffer, rpos, unit->len);
+		}
+		return 0;
+	}
+	memcpy(buffer, rpos + head, length);
+	rpos += head + length;
+	unit->len -= head + length;
+	if(unit->len > 0){
+		memmove(unit->buffer, rpos, unit->len);
+	}
+	return length | UNPACK_COMPACT | ((value & 1) ? UNPACK_COMPRESSED : 0);
+}
+
 static ushort unpack_get_peer(struct unpack_unit * unit, char * buffer){
 	ushort length = 0, len = 0;
 	char * rpos = unit->buffer;
-	while(unit->len && EMC_HEAD != *(ushort*)rpos){
+	while(unit->len && EMC_HEAD != *(ushort*)rpos && EMC_HEAD_COMPACT != *(ushort*)rpos){
 		rpos ++;
 		unit->len --;
 	}
 	if(!unit->len) return 0;
+	if(EMC_HEAD_COMPACT == *(ushort*)rpos){
+		return unpack_get_compact(unit, rpos, buffer);
+	}
 	len = length = *(ushort*)(rpos + sizeof(ushort));
-	if(0x8000 < length){// After compression
-		length ^= 0x8000;
+	if(UNPACK_COMPRESSED < length){// After compression
+		length ^= UNPACK_COMPRESSED;
 	}
 	if(length > MAX_DATA_SIZE){
 		memmove(unit->buffer, rpos + sizeof(ushort), unit->len - sizeof(ushort));
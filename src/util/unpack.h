@@ -39,6 +39,10 @@ extern "C"{
 
 struct unpack;
 
+// Flags in the length passed to the callback
+#define UNPACK_COMPRESSED	0x8000	// The payload is compressed
+#define UNPACK_COMPACT		0x4000	// Compact frame,the data is the bare payload
+
 typedef void unpack_get_data(char * data, unsigned short len, int id, void * args);
 
 // Create an unpacker, max indicates how many different socket while unpacking the maximum allowed, 
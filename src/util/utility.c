@@ -38,6 +38,19 @@ int64 time_get_time(){
 	return (ts.time * 1000 + ts.millitm);
 }
 
+int64 time_get_micro(){
+#if defined (EMC_WINDOWS)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts = {0};
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 emc_result_t emc_thread(emc_thread_cb * cb, void * args){
 	thread_t thrd = 0;
 	if(0 == thread_create(&thrd, NULL, cb, args)){
@@ -58,13 +71,35 @@ unsigned int get_thread_id(){
 #endif
 }
 
-unsigned int check_local_machine(int ip){
+unsigned int check_local_machine(const char * ip){
+	struct in_addr addr4 = {0};
+	struct in6_addr addr6;
+	int family = AF_INET;
+#if defined (EMC_WINDOWS)
 	char name[PATH_LEN] = {0};
 	struct hostent * ent = NULL;
 	int index = 0;
+#else
+	struct ifaddrs * ifs = NULL, * ifa = NULL;
+	uint result = 0;
+#endif
 
-	if(LOOPBACK == ip) return 1;
-	if(gethostname(name, PATH_LEN) < 0){
+	if(1 == inet_pton(AF_INET, ip, &addr4)){
+		if(LOOPBACK == addr4.s_addr) return 1;
+	}else if(1 == inet_pton(AF_INET6, ip, &addr6)){
+		if(IN6_IS_ADDR_LOOPBACK(&addr6)) return 1;
+		// An ipv4 peer written in the ipv6 form
+		if(IN6_IS_ADDR_V4MAPPED(&addr6)){
+			memcpy(&addr4, (char *)&addr6 + 12, sizeof(struct in_addr));
+			if(LOOPBACK == addr4.s_addr) return 1;
+		}else{
+			family = AF_INET6;
+		}
+	}else{
+		return 0;
+	}
+#if defined (EMC_WINDOWS)
+	if(AF_INET != family || gethostname(name, PATH_LEN) < 0){
 		return 0;
 	}
 	ent = gethostbyname(name);
@@ -72,11 +107,27 @@ unsigned int check_local_machine(int ip){
 		return 0;
 	}
 	for(index = 0; ent->h_addr_list[index]; index ++){
-		if(ip == ((struct sockaddr_in *)ent->h_addr_list[index])->sin_addr.s_addr){
+		if(addr4.s_addr == ((struct in_addr *)ent->h_addr_list[index])->s_addr){
 			return 1;
 		}
 	}
 	return 0;
+#else
+	// The interface list comes from the kernel,no name lookup that could block
+	if(getifaddrs(&ifs) < 0){
+		return 0;
+	}
+	for(ifa = ifs; ifa && !result; ifa = ifa->ifa_next){
+		if(!ifa->ifa_addr || family != ifa->ifa_addr->sa_family) continue;
+		if(AF_INET == family){
+			result = addr4.s_addr == ((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr;
+		}else{
+			result = !memcmp(&addr6, &((struct sockaddr_in6 *)ifa->ifa_addr)->sin6_addr, sizeof(struct in6_addr));
+		}
+	}
+	freeifaddrs(ifs);
+	return result;
+#endif
 }
 
 //ȡcpu
@@ -112,6 +163,38 @@ void micro_wait(int64 microseconds){
 #endif
 }
 
+int set_thread_affinity(uint64 mask){
+#if defined (EMC_WINDOWS)
+	return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask) ? 0 : -1;
+#else
+	uint index = 0;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(index = 0; index < 64; index ++){
+		if(mask & ((uint64)1 << index)){
+			CPU_SET(index, &set);
+		}
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set) ? -1 : 0;
+#endif
+}
+
+uint64 get_mask_cpu(uint64 mask, uint index){
+	uint bit = 0, count = 0;
+	for(bit = 0; bit < 64; bit ++){
+		if(mask & ((uint64)1 << bit)) count ++;
+	}
+	if(!count) return 0;
+	index %= count;
+	for(bit = 0; bit < 64; bit ++){
+		if(mask & ((uint64)1 << bit)){
+			if(!index) return (uint64)1 << bit;
+			index --;
+		}
+	}
+	return 0;
+}
+
 int emc_errno(void){
 	return errno;
 }
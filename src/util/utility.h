@@ -35,9 +35,12 @@ extern "C" {
 
 	int64 time_get_time();
 
+	// Monotonic time in microseconds
+	int64 time_get_micro();
+
 	unsigned int get_thread_id();
 
-	unsigned int check_local_machine(int ip);
+	unsigned int check_local_machine(const char * ip);
 
 	// Get the number of cpu
 	unsigned int get_cpu_num();
@@ -45,6 +48,12 @@ extern "C" {
 	// Wait microsecond
 	void micro_wait(int64 microseconds);
 
+	// Bind the calling thread to the cpus of the mask
+	int set_thread_affinity(uint64 mask);
+
+	// Get the index'th cpu of the mask,wrapping around
+	uint64 get_mask_cpu(uint64 mask, uint index);
+
 #ifdef __cplusplus
 }
 #endif
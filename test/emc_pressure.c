@@ -29,19 +29,97 @@
 #include <stdio.h>   
 #include <stdlib.h>
 #include <memory.h>
+#if defined (_WIN32)
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
 #include "../src/emc.h"
 
+// Number of round trips measured by the benchmark
+#define BENCH_COUNT 1000
+
 struct para{
 	int device;
 	int plug;
 	int exit;
+	// The benchmark reads the replies itself,
+	// the receiver thread stays out of emc_recv while paused is set
+	volatile int bench;
+	volatile int paused;
 };
 
+static void sleep_milli(int milli){
+#if defined (_WIN32)
+	Sleep(milli);
+#else
+	usleep(milli*1000);
+#endif
+}
+
+static double now_micro(void){
+#if defined (_WIN32)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (double)now.QuadPart * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec * 1000000 + (double)ts.tv_nsec / 1000;
+#endif
+}
+
+static int compare_double(const void *a, const void *b){
+	double x=*(const double *)a, y=*(const double *)b;
+	return x<y?-1:(x>y?1:0);
+}
+
+// Send requests one at a time and report the round trip percentiles
+static void RunBenchmark(struct para *pa, int length){
+	double *rtt=(double *)malloc(sizeof(double)*BENCH_COUNT);
+	double start=0;
+	void *msg=NULL,*reply=NULL;
+	int index=0,done=0;
+
+	if(!rtt) return;
+	// Wait until the receiver thread has left emc_recv,else it may take a reply
+	pa->bench=1;
+	while(!pa->paused){
+		sleep_milli(1);
+	}
+	for(index=0;index<BENCH_COUNT;index++){
+		msg=emc_msg_alloc(NULL,length);
+		emc_msg_set_mode(msg,EMC_REQ);
+		start=now_micro();
+		if(0==emc_send(pa->plug,msg,0) && 0==emc_recv(pa->plug,&reply,0)){
+			rtt[done++]=now_micro()-start;
+			emc_msg_free(reply);
+		}
+		emc_msg_free(msg);
+	}
+	pa->bench=0;
+	if(done){
+		qsort(rtt,done,sizeof(double),compare_double);
+		printf("round trips=%d,p50=%.0fus,p99=%.0fus,max=%.0fus\n",done,rtt[done/2],rtt[done*99/100],rtt[done-1]);
+	}
+	free(rtt);
+}
+
 static emc_cb_t EMC_CALL OnRecvMsg(void *p){
 	struct para *pa=(struct para *)p;
 	int plug=pa->plug;
 	void *msg=NULL;
 	while(!pa->exit){
+		if(pa->bench){
+			pa->paused=1;
+			while(pa->bench && !pa->exit){
+				sleep_milli(1);
+			}
+			pa->paused=0;
+			continue;
+		}
 		if(0==emc_recv(plug, (void **)&msg, EMC_NOWAIT)){
 			printf("recv length=%ld\n",emc_msg_length(msg));
 			emc_send(plug, msg, EMC_NOWAIT);
@@ -79,8 +157,8 @@ static emc_cb_t EMC_CALL OnMonitorDevice(void *p){
 
 int main(int argc, char* argv[]){
 	int ch=0;int device=-1,plug=-1;
-	char ip[16]={0};
-	int monitor=1,length=0,port=0;
+	char ip[46]={0};
+	int monitor=1,length=0,port=0,busypoll=0;
 	void *msg=NULL;void *msg_=NULL;
 	struct para pa={0};
 
@@ -93,6 +171,9 @@ int main(int argc, char* argv[]){
 	scanf("%ld",&port);
 	emc_thread(OnMonitorDevice,(void *)&pa);
 	emc_set(device,EMC_OPT_MONITOR,&monitor,sizeof(int));
+	printf("Input busy poll budget[microseconds,0-off]:");
+	scanf("%d",&busypoll);
+	emc_set(device,EMC_OPT_BUSYPOLL,&busypoll,sizeof(int));
 	printf("Input mode(1-req,8-sub):");
 	scanf("%ld",&ch);
 	plug = emc_plug(device);
@@ -102,7 +183,7 @@ int main(int argc, char* argv[]){
 	printf("Input send data length[Bytes]:");
 	scanf("%ld",&length);
 	if(EMC_REQ==ch){
-		printf("You choose REQREP mode,type S or s to send data and type Q or q to quit\n");
+		printf("You choose REQREP mode,type S or s to send data,B or b to measure the round trip time and type Q or q to quit\n");
 		while(1){
 			ch=getchar();
 			if('S'==ch || 's'==ch){
@@ -110,6 +191,8 @@ int main(int argc, char* argv[]){
 				emc_msg_set_mode(msg,EMC_REQ);
 				emc_send(plug,msg,0);
 				emc_msg_free(msg);
+			}else if('B'==ch || 'b'==ch){
+				RunBenchmark(&pa,length);
 			}else if('Q'==ch || 'q'==ch){
 				pa.exit=1;
 				break;
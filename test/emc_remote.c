@@ -78,7 +78,7 @@ static emc_cb_t EMC_CALL OnMonitorDevice(void *p){
 
 int main(int argc, char* argv[]){
 	int ch=0;int device=-1,plug=-1;
-	char ip[16]={0};
+	char ip[46]={0};
 	int monitor=1,length=0,port=0;
 	void *msg=NULL;void *msg_=NULL;
 	struct para pa={0};